@@ -0,0 +1,551 @@
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+/* Needs _GNU_SOURCE (or _POSIX_C_SOURCE >= 200809L) defined before the first
+ * system header for pwrite and clock_gettime under -std=c11.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define ASYNC_WRITER_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
+
+static const size_t ASYNC_WRITER_BUFFER_SIZE = 1<<20;
+static const size_t ASYNC_WRITER_MAX_RECORD = 4096;
+
+typedef enum _async_backend {
+  ASYNC_BACKEND_WRITE,    /* not seekable, e.g. a pipe */
+  ASYNC_BACKEND_PWRITE,
+  ASYNC_BACKEND_IO_URING
+} async_backend;
+
+
+#ifdef ASYNC_WRITER_IO_URING
+/* Minimal io_uring (no liburing): one submission, one completion at a time.
+ * The writer thread only ever has a single write in flight, so this needs
+ * no more than the raw rings.
+ */
+typedef struct _async_uring {
+  int fd;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+} async_uring;
+
+
+int
+async_uring_init(async_uring *ring)
+{
+  assert(ring != NULL);
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  long fd = syscall(__NR_io_uring_setup, 2, &params);
+  if (fd < 0) {
+    return -1;
+  }
+  ring->fd = (int) fd;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes
+    + params.cq_entries*sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    close(ring->fd);
+    return -1;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd,
+			 IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      munmap(ring->sq_ring, ring->sq_ring_size);
+      close(ring->fd);
+      return -1;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries*sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cq_ring != ring->sq_ring) {
+      munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+    return -1;
+  }
+
+  char *sq = ring->sq_ring;
+  char *cq = ring->cq_ring;
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+  return 0;
+}
+
+
+void
+async_uring_free(async_uring *ring)
+{
+  assert(ring != NULL);
+
+  munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != ring->sq_ring) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+
+/* Returns the number of bytes written or -errno, like a pwrite syscall */
+ssize_t
+async_uring_pwrite(async_uring *ring, const int fd, const void *data,
+		   const size_t size, const off_t offset)
+{
+  assert(ring != NULL);
+
+  unsigned tail = *(ring->sq_tail);
+  unsigned index = tail & *(ring->sq_mask);
+  struct io_uring_sqe *sqe = &(ring->sqes[index]);
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t) (uintptr_t) data;
+  sqe->len = (uint32_t) size;
+  sqe->off = (uint64_t) offset;
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail+1, __ATOMIC_RELEASE);
+
+  long submitted = syscall(__NR_io_uring_enter, ring->fd, 1, 1,
+			   IORING_ENTER_GETEVENTS, NULL, 0);
+  if (submitted < 0) {
+    return -errno;
+  }
+
+  unsigned head = *(ring->cq_head);
+  while (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    long err = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+		       IORING_ENTER_GETEVENTS, NULL, 0);
+    if (err < 0 && errno != EINTR) {
+      return -errno;
+    }
+  }
+  int res = ring->cqes[head & *(ring->cq_mask)].res;
+  __atomic_store_n(ring->cq_head, head+1, __ATOMIC_RELEASE);
+
+  return res;
+}
+#endif
+
+
+typedef struct _async_buffer {
+  char *data;
+  size_t used;
+  int full;
+} async_buffer;
+
+/* Double buffered output: the compute thread fills one buffer while a
+ * background thread drains the other to disk. The compute side only blocks
+ * when both buffers are in flight, and that time is accumulated in
+ * stall_seconds.
+ */
+typedef struct _async_writer {
+  int fd;
+  int owns_fd;
+  off_t offset;
+  async_backend backend;
+#ifdef ASYNC_WRITER_IO_URING
+  async_uring ring;
+#endif
+  async_buffer buffers[2];
+  size_t current;
+  size_t draining;
+  int closing;
+  double stall_seconds;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+} async_writer;
+
+
+double
+async_writer_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+void
+async_writer_drain(async_writer *writer, const async_buffer *buffer)
+{
+  assert(writer != NULL);
+  assert(buffer != NULL);
+
+  size_t done = 0;
+  while (done < buffer->used) {
+    const char *data = buffer->data + done;
+    size_t size = buffer->used - done;
+    ssize_t written;
+
+    switch (writer->backend) {
+#ifdef ASYNC_WRITER_IO_URING
+    case ASYNC_BACKEND_IO_URING:
+      written = async_uring_pwrite(&(writer->ring), writer->fd, data, size,
+				   writer->offset);
+      if (written == -EINVAL || written == -EOPNOTSUPP) {
+	// IORING_OP_WRITE needs linux 5.6, fall back for the rest of the run
+	async_uring_free(&(writer->ring));
+	writer->backend = ASYNC_BACKEND_PWRITE;
+	continue;
+      }
+      if (written < 0) {
+	errno = (int) -written;
+	written = -1;
+      }
+      break;
+#endif
+    case ASYNC_BACKEND_PWRITE:
+      written = pwrite(writer->fd, data, size, writer->offset);
+      break;
+    default:
+      written = write(writer->fd, data, size);
+      break;
+    }
+
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    assert(written > 0);
+    done += written;
+    writer->offset += written;
+  }
+}
+
+
+void *
+async_writer_main(void *arg)
+{
+  async_writer *writer = arg;
+  assert(writer != NULL);
+
+  pthread_mutex_lock(&(writer->lock));
+  while (1) {
+    async_buffer *buffer = &(writer->buffers[writer->draining]);
+    while (!buffer->full && !writer->closing) {
+      pthread_cond_wait(&(writer->cond), &(writer->lock));
+    }
+    if (!buffer->full) {
+      break;
+    }
+
+    pthread_mutex_unlock(&(writer->lock));
+    async_writer_drain(writer, buffer);
+    pthread_mutex_lock(&(writer->lock));
+
+    buffer->used = 0;
+    buffer->full = 0;
+    writer->draining ^= 1;
+    pthread_cond_broadcast(&(writer->cond));
+  }
+  pthread_mutex_unlock(&(writer->lock));
+
+  return NULL;
+}
+
+
+/**
+ * async_writer_fdopen: Starts a background writer on an already open file
+ *     descriptor. Seekable files it owns are written with io_uring when
+ *     the kernel allows it and pwrite otherwise, anything else with write.
+ *
+ * Requires: - fd is a valid file descriptor open for writing
+ *
+ * Ensures: - returns a writer which must be closed with async_writer_close
+ *
+ * Notes: - a single writer must only be used by one thread at a time
+ *        - will halt on violation of checkable requirements
+ *
+ */
+async_writer *
+async_writer_fdopen(const int fd, const int owns_fd)
+{
+  assert(fd >= 0);
+
+  async_writer *writer = calloc(1, sizeof(async_writer));
+  assert(writer != NULL);
+  writer->fd = fd;
+  writer->owns_fd = owns_fd;
+
+  // explicit offsets never move the shared file offset, so an inherited fd
+  // such as stdout (which the caller may write to again) must use write
+  writer->offset = owns_fd ? lseek(fd, 0, SEEK_END) : -1;
+  writer->backend = (writer->offset < 0) ?
+    ASYNC_BACKEND_WRITE : ASYNC_BACKEND_PWRITE;
+  if (writer->offset < 0) {
+    writer->offset = 0;
+  }
+#ifdef ASYNC_WRITER_IO_URING
+  if (writer->backend == ASYNC_BACKEND_PWRITE &&
+      async_uring_init(&(writer->ring)) == 0) {
+    writer->backend = ASYNC_BACKEND_IO_URING;
+  }
+#endif
+
+  for (size_t i=0; i<2; i++) {
+    writer->buffers[i].data = malloc(ASYNC_WRITER_BUFFER_SIZE);
+    assert(writer->buffers[i].data != NULL);
+  }
+
+  pthread_mutex_init(&(writer->lock), NULL);
+  pthread_cond_init(&(writer->cond), NULL);
+  int err = pthread_create(&(writer->thread), NULL, async_writer_main, writer);
+  assert(err == 0);
+
+  return writer;
+}
+
+
+/**
+ * async_writer_open: Opens 'filename' for writing, truncating it or
+ *     appending to it, and starts a background writer on it
+ *
+ * Requires: - filename is a valid path
+ *
+ * Ensures: - returns a writer which must be closed with async_writer_close
+ *
+ * Notes: - will halt on violation of checkable requirements
+ *
+ */
+async_writer *
+async_writer_open(const char *filename, const int append)
+{
+  assert(filename != NULL);
+
+  int flags = O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC);
+  int fd = open(filename, flags, 0644);
+  assert(fd >= 0);
+
+  return async_writer_fdopen(fd, 1);
+}
+
+
+/* Hands the current buffer to the writer thread and moves on to the other
+ * one, waiting for it to be drained if it is still in flight.
+ */
+void
+async_writer_submit(async_writer *writer)
+{
+  assert(writer != NULL);
+
+  pthread_mutex_lock(&(writer->lock));
+  writer->buffers[writer->current].full = 1;
+  pthread_cond_broadcast(&(writer->cond));
+
+  writer->current ^= 1;
+  if (writer->buffers[writer->current].full) {
+    double start = async_writer_now();
+    while (writer->buffers[writer->current].full) {
+      pthread_cond_wait(&(writer->cond), &(writer->lock));
+    }
+    writer->stall_seconds += async_writer_now() - start;
+  }
+  pthread_mutex_unlock(&(writer->lock));
+}
+
+
+/* Hands over whatever is buffered now instead of waiting for a full buffer,
+ * e.g. at the end of a batch a reader is waiting for. With one buffer still
+ * in flight this blocks until it has drained, which is what throttles a
+ * producer that runs ahead of a slow reader.
+ */
+void
+async_writer_flush(async_writer *writer)
+{
+  assert(writer != NULL);
+
+  if (writer->buffers[writer->current].used > 0) {
+    async_writer_submit(writer);
+  }
+}
+
+
+/**
+ * async_writer_reserve: Returns space for at least 'size' bytes at the end
+ *     of the current buffer, to be filled in place and then passed to
+ *     async_writer_commit
+ *
+ * Requires: - size <= ASYNC_WRITER_BUFFER_SIZE
+ *
+ */
+char *
+async_writer_reserve(async_writer *writer, const size_t size)
+{
+  assert(writer != NULL);
+  assert(size <= ASYNC_WRITER_BUFFER_SIZE);
+
+  async_buffer *buffer = &(writer->buffers[writer->current]);
+  if (buffer->used + size > ASYNC_WRITER_BUFFER_SIZE) {
+    async_writer_submit(writer);
+    buffer = &(writer->buffers[writer->current]);
+  }
+  return buffer->data + buffer->used;
+}
+
+
+void
+async_writer_commit(async_writer *writer, const size_t size)
+{
+  assert(writer != NULL);
+
+  async_buffer *buffer = &(writer->buffers[writer->current]);
+  assert(buffer->used + size <= ASYNC_WRITER_BUFFER_SIZE);
+  buffer->used += size;
+}
+
+
+void
+async_writer_write(async_writer *writer, const void *data, const size_t size)
+{
+  assert(writer != NULL);
+  assert(data != NULL);
+
+  const char *bytes = data;
+  size_t done = 0;
+  while (done < size) {
+    size_t part = size - done;
+    if (part > ASYNC_WRITER_BUFFER_SIZE) {
+      part = ASYNC_WRITER_BUFFER_SIZE;
+    }
+    char *space = async_writer_reserve(writer, part);
+    memcpy(space, bytes + done, part);
+    async_writer_commit(writer, part);
+    done += part;
+  }
+}
+
+
+/* Formatted output of at most ASYNC_WRITER_MAX_RECORD bytes per call */
+void
+async_writer_printf(async_writer *writer, const char *format, ...)
+{
+  assert(writer != NULL);
+  assert(format != NULL);
+
+  char *space = async_writer_reserve(writer, ASYNC_WRITER_MAX_RECORD);
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(space, ASYNC_WRITER_MAX_RECORD, format, args);
+  va_end(args);
+  assert(len >= 0 && (size_t) len < ASYNC_WRITER_MAX_RECORD);
+  async_writer_commit(writer, len);
+}
+
+
+const char *
+async_writer_backend_name(const async_writer *writer)
+{
+  assert(writer != NULL);
+
+  switch (writer->backend) {
+  case ASYNC_BACKEND_IO_URING:
+    return "io_uring";
+  case ASYNC_BACKEND_PWRITE:
+    return "pwrite";
+  default:
+    return "write";
+  }
+}
+
+
+/**
+ * async_writer_close: Flushes everything written so far, stops the writer
+ *     thread and frees the writer
+ *
+ * Ensures: - all data has reached the file descriptor
+ *          - returns the seconds the caller spent waiting on full buffers
+ *
+ */
+double
+async_writer_close(async_writer *writer)
+{
+  assert(writer != NULL);
+
+  if (writer->buffers[writer->current].used > 0) {
+    async_writer_submit(writer);
+  }
+
+  pthread_mutex_lock(&(writer->lock));
+  writer->closing = 1;
+  pthread_cond_broadcast(&(writer->cond));
+  pthread_mutex_unlock(&(writer->lock));
+  int err = pthread_join(writer->thread, NULL);
+  assert(err == 0);
+
+#ifdef ASYNC_WRITER_IO_URING
+  if (writer->backend == ASYNC_BACKEND_IO_URING) {
+    async_uring_free(&(writer->ring));
+  }
+#endif
+  if (writer->owns_fd) {
+    close(writer->fd);
+  }
+  pthread_mutex_destroy(&(writer->lock));
+  pthread_cond_destroy(&(writer->cond));
+  free(writer->buffers[0].data);
+  free(writer->buffers[1].data);
+
+  double stall = writer->stall_seconds;
+  free(writer);
+  return stall;
+}
+
+
+#endif
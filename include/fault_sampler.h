@@ -0,0 +1,87 @@
+#ifndef FAULT_SAMPLER_H
+#define FAULT_SAMPLER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+
+size_t
+rand_size(size_t low, size_t high)
+{
+  assert(low <= high);
+
+  size_t range = (high - low);
+  return low + (rand() % (range+1));
+}
+
+
+/* Sequential selection of exactly 'fault_count' distinct entries out of
+ * 'steps', in increasing order and in constant memory (Vitter's method A).
+ * Used by the chunked runner, which never holds the whole input at once.
+ */
+typedef struct _fault_sampler {
+  uint64_t remaining;   /* faults left to place */
+  uint64_t population;  /* entries left to consider */
+  uint64_t cursor;      /* absolute index of the first entry left */
+  uint64_t next;        /* absolute index of the next faulty entry */
+} fault_sampler;
+
+
+double
+rand_unit()
+{
+  return rand() / (RAND_MAX + 1.0);
+}
+
+
+void
+fault_sampler_advance(fault_sampler *sampler)
+{
+  assert(sampler != NULL);
+
+  if (sampler->remaining == 0) {
+    sampler->next = UINT64_MAX;
+    return;
+  }
+
+  uint64_t skip = 0;
+  double v = rand_unit();
+  if (sampler->remaining == 1) {
+    skip = (uint64_t) (sampler->population * v);
+  } else {
+    double top = (double) (sampler->population - sampler->remaining);
+    double pop = (double) sampler->population;
+    double quot = top / pop;
+    while (quot > v) {
+      skip++;
+      top--;
+      pop--;
+      quot = quot * top / pop;
+    }
+  }
+  assert(skip < sampler->population);
+
+  sampler->next = sampler->cursor + skip;
+  sampler->cursor = sampler->next + 1;
+  sampler->population -= skip + 1;
+  sampler->remaining--;
+}
+
+
+void
+fault_sampler_init(fault_sampler *sampler, const uint64_t steps,
+		   const uint64_t fault_count)
+{
+  assert(sampler != NULL);
+  assert(fault_count <= steps);
+
+  sampler->remaining = fault_count;
+  sampler->population = steps;
+  sampler->cursor = 0;
+  sampler->next = 0;
+  fault_sampler_advance(sampler);
+}
+
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef FEATURE_STREAM_H
+#define FEATURE_STREAM_H
+
+/* Needs _GNU_SOURCE defined before the first system header, as for
+ * async_writer.h.
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "async_writer.h"
+
+/* Streaming of labelled feature batches to an online consumer.
+ *
+ * The stream is a sequence of frames, all fields in host byte order:
+ *
+ *   uint32_t length            bytes that follow this field
+ *   char     magic[4]          "HLFB"
+ *   uint32_t records           0 marks the end of the stream
+ *   uint32_t features
+ *   records times:
+ *     int32_t label            +1 clean, -1 corrupted
+ *     float   norms[features]
+ *     int32_t hi[features]
+ *     int32_t lo[features]
+ *
+ * Frames go through an async_writer and are flushed one batch at a time,
+ * so a reader sees every batch as soon as it is complete. Writes block when
+ * the reader falls behind, at most one batch being in flight while the
+ * next is filled.
+ */
+
+static const char FEATURE_STREAM_MAGIC[4] = {'H', 'L', 'F', 'B'};
+
+typedef struct _feature_frame_header {
+  uint32_t length;
+  char magic[4];
+  uint32_t records;
+  uint32_t features;
+} feature_frame_header;
+
+typedef struct _feature_stream {
+  async_writer *out;
+  uint32_t features;
+  uint32_t batch_size;
+  uint32_t records;      /* records in the batch being filled */
+  size_t record_size;
+  char *batch;           /* batch_size records */
+  size_t batches;         /* data frames sent, not counting the end frame */
+} feature_stream;
+
+
+/* Sets *length to the frame length field for 'records' records of
+ * 'record_size' bytes, returning 0 if it does not fit in a uint32_t
+ */
+int
+feature_frame_length(const size_t records, const size_t record_size,
+		     uint32_t *length)
+{
+  assert(record_size > 0);
+  assert(length != NULL);
+
+  const size_t fixed = sizeof(feature_frame_header) - sizeof(uint32_t);
+  if (records > (UINT32_MAX - fixed)/record_size) {
+    return 0;
+  }
+  *length = (uint32_t) (fixed + records*record_size);
+  return 1;
+}
+
+
+/* Whether a full batch of 'features' wide records fits in one frame */
+int
+feature_stream_fits(const size_t features, const size_t batch_size)
+{
+  if (features == 0 || batch_size == 0 ||
+      features > UINT32_MAX || batch_size > UINT32_MAX ||
+      features > (SIZE_MAX/sizeof(int32_t) - 1)/3) {
+    return 0;
+  }
+  uint32_t length;
+  return feature_frame_length(batch_size,
+			      sizeof(int32_t) + 3*features*sizeof(int32_t),
+			      &length);
+}
+
+
+/**
+ * feature_stream_listen: Binds a Unix domain stream socket at 'path' and
+ *     waits for one consumer to connect
+ *
+ * Requires: - nothing exists at path
+ *
+ * Ensures: - returns the connected socket
+ *          - path is removed again once the consumer is connected
+ *
+ */
+int
+feature_stream_listen(const char *path)
+{
+  assert(path != NULL);
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  assert(strlen(path) < sizeof(address.sun_path));
+  strcpy(address.sun_path, path);
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  assert(listener >= 0);
+  int err = bind(listener, (struct sockaddr *) &address, sizeof(address));
+  assert(err == 0);
+  err = listen(listener, 1);
+  assert(err == 0);
+
+  int fd = accept(listener, NULL, NULL);
+  assert(fd >= 0);
+  close(listener);
+  unlink(path);
+
+  return fd;
+}
+
+
+/**
+ * feature_stream_open: Starts a stream of 'features' wide records on fd,
+ *     sent in frames of up to batch_size records
+ *
+ * Requires: - fd is a valid file descriptor open for writing
+ *           - feature_stream_fits(features, batch_size)
+ *
+ * Ensures: - s must be finished with feature_stream_close
+ *
+ */
+void
+feature_stream_open(feature_stream *s, const int fd, const int owns_fd,
+		    const uint32_t features, const uint32_t batch_size)
+{
+  assert(s != NULL);
+  assert(feature_stream_fits(features, batch_size));
+
+  s->out = async_writer_fdopen(fd, owns_fd);
+  s->features = features;
+  s->batch_size = batch_size;
+  s->records = 0;
+  s->record_size = sizeof(int32_t) + 3*features*sizeof(int32_t);
+  s->batch = malloc(batch_size*s->record_size);
+  assert(s->batch != NULL);
+  s->batches = 0;
+}
+
+
+/* Sends the records collected so far as one frame, even if there are none */
+void
+feature_stream_send(feature_stream *s)
+{
+  assert(s != NULL);
+
+  feature_frame_header header;
+  if (!feature_frame_length(s->records, s->record_size, &(header.length))) {
+    fprintf(stderr, "feature_stream: %" PRIu32 " records overflow a frame\n",
+	    s->records);
+    abort();
+  }
+  memcpy(header.magic, FEATURE_STREAM_MAGIC, sizeof(header.magic));
+  header.records = s->records;
+  header.features = s->features;
+
+  async_writer_write(s->out, &header, sizeof(header));
+  if (s->records > 0) {
+    async_writer_write(s->out, s->batch, s->records*s->record_size);
+  }
+  async_writer_flush(s->out);
+
+  s->batches += (s->records > 0);
+  s->records = 0;
+}
+
+
+/**
+ * feature_stream_add: Appends one labelled record, sending the batch once
+ *     it holds batch_size records
+ *
+ * Requires: - norms, hi and lo hold s->features values each
+ *
+ */
+void
+feature_stream_add(feature_stream *s, const int32_t label, const float *norms,
+		   const int32_t *hi, const int32_t *lo)
+{
+  assert(s != NULL);
+  assert(label == 1 || label == -1);
+  assert(norms != NULL && hi != NULL && lo != NULL);
+
+  char *record = s->batch + s->records*s->record_size;
+  size_t row = s->features*sizeof(int32_t);
+  memcpy(record, &label, sizeof(label));
+  memcpy(record + sizeof(label), norms, row);
+  memcpy(record + sizeof(label) + row, hi, row);
+  memcpy(record + sizeof(label) + 2*row, lo, row);
+
+  s->records++;
+  if (s->records == s->batch_size) {
+    feature_stream_send(s);
+  }
+}
+
+
+/**
+ * feature_stream_close: Sends any partial batch, then the empty end of
+ *     stream frame, and closes the writer
+ *
+ * Ensures: - returns the seconds spent blocked on the consumer
+ *
+ */
+double
+feature_stream_close(feature_stream *s)
+{
+  assert(s != NULL);
+
+  if (s->records > 0) {
+    feature_stream_send(s);
+  }
+  feature_stream_send(s);
+
+  free(s->batch);
+  s->batch = NULL;
+  return async_writer_close(s->out);
+}
+
+
+#endif
@@ -66,6 +66,44 @@ split_float(const float x, const int32_t m,
 }
 
 
+/**
+ * split_float_flip: Given the int memory reinterperetation 'x_int' of a float
+ *     and its product 'y' with the int 'm', computes the high and low bits of
+ *     the product after flipping bit 'bit' of x_int. The flip changes x_int by
+ *     exactly +-2^bit, so the product changes by +-(2^bit * m) and neither a
+ *     transmute nor a multiply is needed.
+ *
+ * Requires: - bit < 32
+ *           - y == (int64_t) x_int * m
+ *           - out_hi is a valid *int32_t
+ *           - out_lo is a valid *int32_t
+ *
+ * Ensures: - no crash can occur
+ *          - inout variables are assigned as split_float would for the
+ *            flipped value
+ *
+ * Notes: - not thread safe
+ *        - if requirements are not met then ensures are not garanteed
+ *        - will halt on violation of checkable requirements
+ *
+ */
+void
+split_float_flip(const int32_t x_int, const int64_t y, const int32_t m,
+		 const size_t bit, int32_t *hi_out, int32_t *lo_out)
+{
+  assert(bit < 32);
+  assert(hi_out != NULL);
+  assert(lo_out != NULL);
+
+  // bit 31 is the two's complement sign bit, worth -2^31
+  int64_t weight = (bit == 31) ? -(INT64_C(1) << 31) : (INT64_C(1) << bit);
+  int64_t delta = (((uint32_t) x_int >> bit) & 1) ? -weight : weight;
+  int64_t yp = y + delta * m;
+  *hi_out = yp >> 32;
+  *lo_out = ((yp << 32) >> 32);
+}
+
+
 /**
  * split_array: Given an input array multiplies the int memory reinterperetation
  *     of that array by the int 'm'. The high bits of the output are stored in
@@ -173,5 +211,369 @@ split_2d_array(const size_t in_x, const size_t in_y, const float **in_array,
 }
 
 
+/**
+ * split_3d_subgrid: Splits the box [sub_x_start, sub_x_end) x
+ *     [sub_y_start, sub_y_end) x [sub_z_start, sub_z_end) of a contiguous
+ *     in_x by in_y by in_z volume, entry (x, y, z) at (x*in_y + y)*in_z + z.
+ *     The hi/lo of each entry are stored at the same position of out_hi and
+ *     out_lo. Each z run of the box is contiguous and is split with one
+ *     split_array call, so the volume is streamed in memory order.
+ *
+ * Requires: - in_array is a valid float array of length in_x*in_y*in_z
+ *           - out_hi, out_lo are valid int32_t arrays of the same length
+ *           - the box is non empty and inside the volume
+ *
+ * Ensures: - no crash can occur
+ *          - entries of out_hi, out_lo outside the box are untouched
+ *
+ * Notes: - not thread safe
+ *        - if requirements are not met then ensures are not garanteed
+ *        - will halt on violation of checkable requirements
+ *
+ */
+void
+split_3d_subgrid(const size_t in_x, const size_t in_y, const size_t in_z,
+		 const float *in_array, const int32_t m,
+		 const size_t sub_x_start, const size_t sub_x_end,
+		 const size_t sub_y_start, const size_t sub_y_end,
+		 const size_t sub_z_start, const size_t sub_z_end,
+		 int32_t *out_hi, int32_t *out_lo)
+{
+  assert(in_array != NULL);
+  assert(out_hi != NULL);
+  assert(out_lo != NULL);
+  assert(sub_x_start < sub_x_end);
+  assert(sub_y_start < sub_y_end);
+  assert(sub_z_start < sub_z_end);
+  assert(sub_x_end <= in_x);
+  assert(sub_y_end <= in_y);
+  assert(sub_z_end <= in_z);
+
+  size_t z_width = sub_z_end - sub_z_start;
+  for (size_t x=sub_x_start; x < sub_x_end; x++) {
+    for (size_t y=sub_y_start; y < sub_y_end; y++) {
+      size_t offset = (x*in_y + y)*in_z + sub_z_start;
+      int32_t *sub_hi = &(out_hi[offset]);
+      int32_t *sub_lo = &(out_lo[offset]);
+      split_array(z_width, &(in_array[offset]), m, &sub_hi, &sub_lo);
+    }
+  }
+}
+
+
+/**
+ * split_3d_array: split_3d_subgrid over the whole of a contiguous in_x by
+ *     in_y by in_z volume
+ *
+ * Requires: - in_array is a valid float array of length in_x*in_y*in_z
+ *           - out_hi, out_lo are valid int32_t arrays of the same length
+ *
+ * Ensures: - no crash can occur
+ *          - inout variables are assigned as described
+ *
+ * Notes: - not thread safe
+ *        - if requirements are not met then ensures are not garanteed
+ *        - will halt on violation of checkable requirements
+ *
+ */
+void
+split_3d_array(const size_t in_x, const size_t in_y, const size_t in_z,
+	       const float *in_array, const int32_t m,
+	       int32_t *out_hi, int32_t *out_lo)
+{
+  assert(in_array != NULL);
+  assert(out_hi != NULL);
+  assert(out_lo != NULL);
+
+  // the whole volume is one contiguous run
+  split_array(in_x*in_y*in_z, in_array, m, &out_hi, &out_lo);
+}
+
+
+/* A 2D field stored in any strided layout: entry (x, y) lives at
+ * base[x*stride_x + y*stride_y]. Row-major arrays, column-major (Fortran)
+ * arrays and the interior of halo padded blocks are all views, so they are
+ * processed in place instead of being copied out first.
+ */
+typedef struct _field_view {
+  float *base;
+  size_t extent_x;
+  size_t extent_y;
+  size_t stride_x;
+  size_t stride_y;
+} field_view;
+
+/* Side of the square blocks transposed through a local tile when the view is
+ * not unit-stride along y
+ */
+#define VIEW_BLOCK 32
+
+
+/* Row-major x by y field with leading dimension ld >= y */
+field_view
+field_view_row_major(float *base, const size_t x, const size_t y,
+		     const size_t ld)
+{
+  assert(base != NULL);
+  assert(ld >= y);
+
+  field_view view = {base, x, y, ld, 1};
+  return view;
+}
+
+
+/* Column-major (Fortran order) x by y field with leading dimension ld >= x */
+field_view
+field_view_col_major(float *base, const size_t x, const size_t y,
+		     const size_t ld)
+{
+  assert(base != NULL);
+  assert(ld >= x);
+
+  field_view view = {base, x, y, 1, ld};
+  return view;
+}
+
+
+/* The [x_start, x_end) x [y_start, y_end) part of a view, e.g. the interior
+ * of a block with halo cells
+ */
+field_view
+field_view_sub(const field_view *view, const size_t x_start, const size_t x_end,
+	       const size_t y_start, const size_t y_end)
+{
+  assert(view != NULL);
+  assert(x_start < x_end && x_end <= view->extent_x);
+  assert(y_start < y_end && y_end <= view->extent_y);
+
+  field_view sub = {view->base + x_start*view->stride_x + y_start*view->stride_y,
+		    x_end - x_start, y_end - y_start,
+		    view->stride_x, view->stride_y};
+  return sub;
+}
+
+
+static inline float *
+field_view_at(const field_view *view, const size_t x, const size_t y)
+{
+  return view->base + x*view->stride_x + y*view->stride_y;
+}
+
+
+/**
+ * split_view: Splits every entry of a strided view into hi/lo, stored
+ *     row-major and dense: (x, y) at out_hi[x*extent_y + y]
+ *
+ * Requires: - view describes valid memory
+ *           - out_hi, out_lo are valid int32_t arrays of length
+ *             extent_x*extent_y
+ *
+ * Ensures: - no crash can occur
+ *          - inout variables are assigned as described
+ *
+ * Notes: - rows that are unit-stride along y are split in place. Any other
+ *          layout is read VIEW_BLOCK x VIEW_BLOCK blocks at a time, walking
+ *          the block along x (unit-stride for column-major data) into a
+ *          transposed local tile whose rows are then split, so neither the
+ *          reads nor the writes stride through memory one entry at a time
+ *        - not thread safe
+ *        - if requirements are not met then ensures are not garanteed
+ *        - will halt on violation of checkable requirements
+ *
+ */
+void
+split_view(const field_view *view, const int32_t m,
+	   int32_t *out_hi, int32_t *out_lo)
+{
+  assert(view != NULL);
+  assert(view->base != NULL);
+  assert(out_hi != NULL);
+  assert(out_lo != NULL);
+
+  const size_t nx = view->extent_x;
+  const size_t ny = view->extent_y;
+
+  if (view->stride_y == 1) {
+    for (size_t x=0; x < nx; x++) {
+      int32_t *hi = &(out_hi[x*ny]);
+      int32_t *lo = &(out_lo[x*ny]);
+      split_array(ny, field_view_at(view, x, 0), m, &hi, &lo);
+    }
+    return;
+  }
+
+  float tile[VIEW_BLOCK][VIEW_BLOCK];
+  for (size_t x0=0; x0 < nx; x0+=VIEW_BLOCK) {
+    size_t bx = (nx - x0 < VIEW_BLOCK) ? nx - x0 : VIEW_BLOCK;
+    for (size_t y0=0; y0 < ny; y0+=VIEW_BLOCK) {
+      size_t by = (ny - y0 < VIEW_BLOCK) ? ny - y0 : VIEW_BLOCK;
+
+      for (size_t y=0; y < by; y++) {
+	const float *column = field_view_at(view, x0, y0+y);
+	for (size_t x=0; x < bx; x++) {
+	  tile[x][y] = column[x*view->stride_x];
+	}
+      }
+
+      for (size_t x=0; x < bx; x++) {
+	int32_t *hi = &(out_hi[(x0+x)*ny + y0]);
+	int32_t *lo = &(out_lo[(x0+x)*ny + y0]);
+	split_array(by, tile[x], m, &hi, &lo);
+      }
+    }
+  }
+}
+
+
+#define VERIFY_BLOCK 64
+
+/* OR of (recomputed product ^ reference product) over n <= VERIFY_BLOCK
+ * entries. Kept as a plain reduction with no early exit so that it
+ * vectorises; the block is transmuted with one memcpy up front, per element
+ * memcpys keep gcc from vectorising the loop. On x86 the signed 32x32->64
+ * multiply needs SSE4.1, e.g. CFLAGS=-march=native.
+ */
+uint64_t
+split_diff(const size_t n, const float *in_array, const int32_t m,
+	   const int32_t *ref_hi, const int32_t *ref_lo)
+{
+  assert(n <= VERIFY_BLOCK);
+
+  int32_t bits[VERIFY_BLOCK];
+  memcpy(bits, in_array, n*sizeof(float));
+
+  uint64_t diff = 0;
+  for (size_t k=0; k < n; k++) {
+    int64_t y = (int64_t) bits[k] * m;
+    uint64_t expected = ((uint64_t) (uint32_t) ref_hi[k] << 32)
+      | (uint32_t) ref_lo[k];
+    diff |= (uint64_t) y ^ expected;
+  }
+  return diff;
+}
+
+
+/**
+ * verify_split_array: Recomputes the split of every float in in_array and
+ *     compares it against the reference planes ref_hi and ref_lo. The
+ *     reference hi/lo pair is compared as the single 64 bit product it was
+ *     split from, one block of VERIFY_BLOCK entries at a time with no
+ *     branches inside a block (split_diff), so the compiler can vectorise
+ *     the check.
+ *
+ * Requires: - in_size is the valid length of in_array, ref_hi and ref_lo
+ *           - in_array is a valid float array
+ *           - ref_hi, ref_lo are valid int32_t arrays
+ *           - mismatches is NULL or has room for max_mismatches entries
+ *
+ * Ensures: - no crash can occur
+ *          - if mismatches is NULL returns 1 at the first block holding a
+ *            mismatch and 0 if there is none (pass/fail)
+ *          - otherwise returns the number of mismatching entries and stores
+ *            the indices of the first max_mismatches of them, in order
+ *
+ * Notes: - not thread safe
+ *        - if requirements are not met then ensures are not garanteed
+ *        - will halt on violation of checkable requirements
+ *
+ */
+size_t
+verify_split_array(const size_t in_size, const float *in_array, const int32_t m,
+		   const int32_t *ref_hi, const int32_t *ref_lo,
+		   size_t *mismatches, const size_t max_mismatches)
+{
+  assert(in_array != NULL);
+  assert(ref_hi != NULL);
+  assert(ref_lo != NULL);
+
+  size_t found = 0;
+  for (size_t base=0; base < in_size; base += VERIFY_BLOCK) {
+    size_t width = (in_size - base < VERIFY_BLOCK) ? in_size - base : VERIFY_BLOCK;
+
+    if (split_diff(width, &(in_array[base]), m,
+		   &(ref_hi[base]), &(ref_lo[base])) == 0) {
+      continue;
+    }
+
+    // rare path: find the exact entries
+    for (size_t k=0; k < width; k++) {
+      int32_t hi, lo;
+      split_float(in_array[base+k], m, &hi, &lo);
+      if (hi == ref_hi[base+k] && lo == ref_lo[base+k]) {
+	continue;
+      }
+      if (mismatches == NULL) {
+	return 1;
+      }
+      if (found < max_mismatches) {
+	mismatches[found] = base+k;
+      }
+      found++;
+    }
+  }
+
+  return found;
+}
+
+
+/**
+ * verify_split_2d: verify_split_array over the subgrid
+ *     [sub_x_start, sub_x_end) x [sub_y_start, sub_y_end) of a row pointer
+ *     array, against reference planes of the same shape as in_array
+ *
+ * Requires: - as split_2d_subgrid, with ref_hi/ref_lo in place of the outputs
+ *           - mismatches is NULL or has room for max_mismatches entries
+ *
+ * Ensures: - as verify_split_array, with mismatches stored as the row-major
+ *            index x*in_y + y into the full array
+ *
+ * Notes: - not thread safe
+ *        - if requirements are not met then ensures are not garanteed
+ *        - will halt on violation of checkable requirements
+ *
+ */
+size_t
+verify_split_2d(const size_t in_x, const size_t in_y, const float **in_array,
+		const int32_t m,
+		const size_t sub_x_start, const size_t sub_x_end,
+		const size_t sub_y_start, const size_t sub_y_end,
+		const int32_t **ref_hi, const int32_t **ref_lo,
+		size_t *mismatches, const size_t max_mismatches)
+{
+  assert(in_array != NULL);
+  assert(ref_hi != NULL);
+  assert(ref_lo != NULL);
+  assert(sub_x_start < sub_x_end);
+  assert(sub_y_start < sub_y_end);
+  assert(sub_x_end <= in_x);
+  assert(sub_y_end <= in_y);
+
+  size_t y_width = sub_y_end - sub_y_start;
+  size_t found = 0;
+  for (size_t index=sub_x_start; index < sub_x_end; index++) {
+    size_t stored = (found < max_mismatches) ? found : max_mismatches;
+    size_t room = max_mismatches - stored;
+    size_t *row_mismatches = (mismatches == NULL) ? NULL : mismatches + stored;
+    size_t row_found = verify_split_array(y_width,
+					  &(in_array[index][sub_y_start]), m,
+					  &(ref_hi[index][sub_y_start]),
+					  &(ref_lo[index][sub_y_start]),
+					  row_mismatches, room);
+    if (mismatches == NULL) {
+      if (row_found) {
+	return 1;
+      }
+      continue;
+    }
+    for (size_t k=0; k < row_found && k < room; k++) {
+      row_mismatches[k] = index*in_y + sub_y_start + row_mismatches[k];
+    }
+    found += row_found;
+  }
+
+  return found;
+}
+
+
 
 #endif
@@ -0,0 +1,289 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+/* Needs _GNU_SOURCE defined before the first system header for
+ * sched_getaffinity and pthread_attr_setaffinity_np.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* Memory placement for the large A x A buffers.
+ *
+ * Buffers are reserved with placement_alloc, which maps them without
+ * touching them and asks for transparent huge pages. placement_run then
+ * splits a range of work units (rows of tiles) into one contiguous band per
+ * worker and runs every worker pinned to its own cpu, so the pages of a band
+ * are first touched, and therefore placed, on the node of the worker that
+ * later reads them. No libnuma is needed, node queries use raw syscalls.
+ */
+
+typedef struct _placement {
+  int threads;
+  int *cpus;   /* cpu each worker is pinned to */
+  int *nodes;  /* node each worker last ran on, -1 if unknown */
+} placement;
+
+typedef void (*placement_band_func)(void *arg, size_t start, size_t end);
+
+typedef struct _placement_job {
+  placement_band_func func;
+  void *arg;
+  size_t start;
+  size_t end;
+  int *node;
+} placement_job;
+
+
+/**
+ * placement_init: Chooses a cpu for each of 'threads' workers, cycling
+ *     through the cpus this process may run on in increasing order
+ *
+ * Requires: - threads > 0
+ *
+ * Ensures: - p must be released with placement_free
+ *
+ */
+void
+placement_init(placement *p, const int threads)
+{
+  assert(p != NULL);
+  assert(threads > 0);
+
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  int err = sched_getaffinity(0, sizeof(allowed), &allowed);
+  assert(err == 0);
+
+  int allowed_cpus[CPU_SETSIZE];
+  int count = 0;
+  for (int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed)) {
+      allowed_cpus[count++] = cpu;
+    }
+  }
+  assert(count > 0);
+
+  p->threads = threads;
+  p->cpus = malloc(threads*sizeof(int));
+  p->nodes = malloc(threads*sizeof(int));
+  assert(p->cpus != NULL);
+  assert(p->nodes != NULL);
+  for (int t=0; t<threads; t++) {
+    p->cpus[t] = allowed_cpus[t % count];
+    p->nodes[t] = -1;
+  }
+}
+
+
+void
+placement_free(placement *p)
+{
+  assert(p != NULL);
+
+  free(p->cpus);
+  free(p->nodes);
+  p->cpus = NULL;
+  p->nodes = NULL;
+}
+
+
+/* Start of worker t's band when 'units' are split over 'threads' workers */
+size_t
+placement_band_start(const size_t units, const int threads, const int t)
+{
+  return (units * (size_t) t) / (size_t) threads;
+}
+
+
+void *
+placement_worker(void *arg)
+{
+  placement_job *job = arg;
+  assert(job != NULL);
+
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) == 0) {
+    *(job->node) = (int) node;
+  }
+  job->func(job->arg, job->start, job->end);
+
+  return NULL;
+}
+
+
+/**
+ * placement_run: Calls func(arg, start, end) once per worker, in parallel,
+ *     with [start, end) the worker's band of [0, units)
+ *
+ * Ensures: - all calls have returned
+ *          - p->nodes holds the node each worker ran on, where known
+ *
+ */
+void
+placement_run(placement *p, const size_t units, placement_band_func func,
+	      void *arg)
+{
+  assert(p != NULL);
+  assert(func != NULL);
+
+  pthread_t *handles = malloc(p->threads*sizeof(pthread_t));
+  placement_job *jobs = malloc(p->threads*sizeof(placement_job));
+  assert(handles != NULL);
+  assert(jobs != NULL);
+
+  for (int t=0; t<p->threads; t++) {
+    jobs[t].func = func;
+    jobs[t].arg = arg;
+    jobs[t].start = placement_band_start(units, p->threads, t);
+    jobs[t].end = placement_band_start(units, p->threads, t+1);
+    jobs[t].node = &(p->nodes[t]);
+
+    // pinned before it starts, so not even its stack is touched elsewhere
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(p->cpus[t], &set);
+    int err = pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    if (err != 0) {
+      // still correct unpinned, only the placement is left to the kernel
+      fprintf(stderr, "placement: cannot pin worker %d to cpu %d (%s),"
+	      " running it unpinned\n", t, p->cpus[t], strerror(err));
+      pthread_attr_destroy(&attr);
+      pthread_attr_init(&attr);
+    }
+    err = pthread_create(&(handles[t]), &attr, placement_worker, &(jobs[t]));
+    assert(err == 0);
+    pthread_attr_destroy(&attr);
+  }
+
+  for (int t=0; t<p->threads; t++) {
+    int err = pthread_join(handles[t], NULL);
+    assert(err == 0);
+  }
+
+  free(handles);
+  free(jobs);
+}
+
+
+/**
+ * placement_alloc: Reserves 'bytes' of untouched memory, requesting
+ *     transparent huge pages for it
+ *
+ * Ensures: - returns a page aligned, zero filled buffer
+ *          - no page is placed until it is first written
+ *
+ * Notes: - the buffers live as long as the run, so there is no matching
+ *          free; the mapping goes away when the process exits
+ *
+ */
+void *
+placement_alloc(const size_t bytes)
+{
+  assert(bytes > 0);
+
+  void *buffer = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert(buffer != MAP_FAILED);
+#ifdef MADV_HUGEPAGE
+  madvise(buffer, bytes, MADV_HUGEPAGE);
+#endif
+  return buffer;
+}
+
+
+/* Node of the page holding 'address', -1 if the kernel can not tell */
+int
+placement_page_node(const void *address)
+{
+  void *page = (void *) ((uintptr_t) address & ~((uintptr_t) sysconf(_SC_PAGESIZE) - 1));
+  int status = -1;
+  long err = syscall(SYS_move_pages, 0, 1UL, &page, NULL, &status, 0);
+  if (err != 0 || status < 0) {
+    return -1;
+  }
+  return status;
+}
+
+
+/**
+ * placement_report: Prints, for a buffer split into 'units' equal bands as
+ *     by placement_run, where the pages of each worker's band ended up
+ *     compared to the node that worker ran on. Up to 'samples' pages are
+ *     checked per band.
+ *
+ */
+void
+placement_report(const placement *p, FILE *out, const char *name,
+		 const void *buffer, const size_t bytes, const size_t units)
+{
+  assert(p != NULL);
+  assert(out != NULL);
+  assert(buffer != NULL);
+
+  const size_t samples = 64;
+  const char *base = buffer;
+
+  for (int t=0; t<p->threads; t++) {
+    size_t start = placement_band_start(units, p->threads, t) * (bytes/units);
+    size_t end = placement_band_start(units, p->threads, t+1) * (bytes/units);
+    if (end <= start) {
+      continue;
+    }
+
+    size_t stride = (end - start) / samples;
+    if (stride == 0) {
+      stride = 1;
+    }
+    size_t checked = 0, local = 0, unknown = 0;
+    for (size_t offset=start; offset<end && checked<samples; offset+=stride) {
+      int node = placement_page_node(base + offset);
+      checked++;
+      if (node < 0) {
+	unknown++;
+      } else if (node == p->nodes[t]) {
+	local++;
+      }
+    }
+
+    if (unknown == checked) {
+      fprintf(out, "placement %s: worker %d cpu %d node %d: page nodes unknown\n",
+	      name, t, p->cpus[t], p->nodes[t]);
+    } else {
+      fprintf(out, "placement %s: worker %d cpu %d node %d: %zu/%zu sampled pages local\n",
+	      name, t, p->cpus[t], p->nodes[t], local, checked);
+    }
+  }
+}
+
+
+/* Prints the transparent huge page policy, e.g. "always [madvise] never" */
+void
+placement_report_thp(FILE *out)
+{
+  assert(out != NULL);
+
+  char policy[128] = "unavailable";
+  FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+  if (fp != NULL) {
+    if (fgets(policy, sizeof(policy), fp) != NULL) {
+      policy[strcspn(policy, "\n")] = '\0';
+    }
+    fclose(fp);
+  }
+  fprintf(out, "placement: transparent huge pages %s\n", policy);
+}
+
+
+#endif
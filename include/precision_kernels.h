@@ -0,0 +1,151 @@
+#ifndef PRECISION_KERNELS_H
+#define PRECISION_KERNELS_H
+
+/* The toy pipeline (generate, map, inject faults, split the product with m
+ * into hi/lo) at every supported precision. precision_template.h is
+ * included once per precision below, so each one gets its own copy of the
+ * inner loops with all types fixed, named with its suffix:
+ *
+ *   f32     float, 32 bit m, product split at bit 32
+ *   f64     double, 64 bit m, product split at bit 64
+ *   f32m64  float, 64 bit m, the 96 bit product split at bit 64
+ *
+ * e.g. pk_run_csv_f32 and pk_run_csv_f64. PK_PRECISIONS lists them all,
+ * toy.c and sweep.c pick one or more of them at run time.
+ *
+ * Needs _GNU_SOURCE defined before the first system header, as for
+ * async_writer.h.
+ */
+
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "async_writer.h"
+#include "fault_sampler.h"
+
+#define PK_CAT_(a, b) a##_##b
+#define PK_CAT(a, b) PK_CAT_(a, b)
+#define PK_FN(name) PK_CAT(name, PK_NAME)
+
+typedef struct _pk_config {
+  double (*func)(double);
+  double low;
+  double high;
+  uint64_t steps;
+  size_t chunk_size;
+  size_t fault_low_bit;
+  size_t fault_high_bit;
+  uint64_t fault_count;
+  uint64_t m;
+  const char *name;       /* first csv column, none if NULL */
+} pk_config;
+
+typedef struct _pk_stats {
+  uint64_t rows;
+  uint64_t tainted;
+  uint64_t hi_changed;
+  uint64_t lo_changed;
+  uint64_t undetected;    /* tainted, yet hi and lo both unchanged */
+} pk_stats;
+
+/* hi/lo of one clean and one faulty value, widened for every precision */
+typedef struct _pk_outcome {
+  uint64_t y_hi;
+  uint64_t yp_hi;
+  uint64_t y_lo;
+  uint64_t yp_lo;
+} pk_outcome;
+
+typedef void (*pk_run_func)(const pk_config *config, async_writer *out,
+			    pk_stats *stats);
+typedef double (*pk_step_size_func)(const double low, const double high,
+				    const uint64_t steps);
+typedef void (*pk_points_func)(double (*func)(double), const double low,
+			       const double step_size, const size_t start,
+			       const size_t count, double *x);
+typedef void (*pk_flip_func)(const double x, const uint64_t m,
+			     const size_t fault_low_bit,
+			     const size_t fault_high_bit, pk_outcome *outcomes);
+
+static const char *PK_CSV_HEADER =
+  "input. x, x', sdc_tainted, y_hi, y'_hi, y_lo, y'_lo\n";
+
+/* Packed columnar format: a fixed header followed by one block per chunk.
+ * Each block is a uint64_t row count followed by the eight columns, in the
+ * same order as the csv, each stored contiguously:
+ *   input, x, x' (float_bytes each), sdc_tainted (int8_t),
+ *   y_hi, y'_hi, y_lo, y'_lo (half_bytes each)
+ */
+static const char PK_COLUMNAR_MAGIC[4] = {'T', 'O', 'Y', 'C'};
+static const uint32_t PK_COLUMNAR_VERSION = 2;
+static const uint32_t PK_COLUMNAR_COLUMNS = 8;
+
+typedef struct _pk_columnar_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t float_bytes;
+  uint32_t columns;
+  uint64_t steps;
+  uint64_t chunk_size;
+  uint32_t half_bytes;
+  uint32_t reserved;
+} pk_columnar_header;
+
+
+#define PK_NAME f32
+#define PK_FLOAT float
+#define PK_BITS uint32_t
+#define PK_MUL uint32_t
+#define PK_WIDE uint64_t
+#define PK_HALF uint32_t
+#define PK_FORMAT "%" PRIu32
+#include "precision_template.h"
+
+#define PK_NAME f64
+#define PK_FLOAT double
+#define PK_BITS uint64_t
+#define PK_MUL uint64_t
+#define PK_WIDE __uint128_t
+#define PK_HALF uint64_t
+#define PK_FORMAT "%" PRIu64
+#include "precision_template.h"
+
+#define PK_NAME f32m64
+#define PK_FLOAT float
+#define PK_BITS uint32_t
+#define PK_MUL uint64_t
+#define PK_WIDE __uint128_t
+#define PK_HALF uint64_t
+#define PK_FORMAT "%" PRIu64
+#include "precision_template.h"
+
+
+/* Every instantiation above, for picking one by name at run time */
+typedef struct _pk_precision {
+  const char *name;
+  size_t float_bits;
+  uint64_t max_m;
+  pk_run_func run_csv;
+  pk_run_func run_columnar;
+  pk_step_size_func step_size;
+  pk_points_func points;
+  pk_flip_func flip_bits;
+} pk_precision;
+
+static const pk_precision PK_PRECISIONS[] =
+  {
+    {"f32", 32, UINT32_MAX, pk_run_csv_f32, pk_run_columnar_f32,
+     pk_step_size_f32, pk_points_block_f32, pk_flip_bits_f32},
+    {"f64", 64, UINT64_MAX, pk_run_csv_f64, pk_run_columnar_f64,
+     pk_step_size_f64, pk_points_block_f64, pk_flip_bits_f64},
+    {"f32m64", 32, UINT64_MAX, pk_run_csv_f32m64, pk_run_columnar_f32m64,
+     pk_step_size_f32m64, pk_points_block_f32m64, pk_flip_bits_f32m64}
+  };
+static const size_t PK_NUM_PRECISIONS =
+  sizeof(PK_PRECISIONS)/sizeof(PK_PRECISIONS[0]);
+
+
+#endif
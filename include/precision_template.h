@@ -0,0 +1,396 @@
+/* Template of the toy pipeline at one precision, instantiated by
+ * precision_kernels.h. There is deliberately no include guard: include it
+ * once per precision, with
+ *
+ *   PK_NAME     suffix of the generated names, e.g. f32
+ *   PK_FLOAT    floating point type of the field
+ *   PK_BITS     unsigned integer type of the same size as PK_FLOAT
+ *   PK_MUL      unsigned integer type of the multiplier m
+ *   PK_WIDE     unsigned integer type holding all of PK_BITS * PK_MUL
+ *   PK_HALF     unsigned integer type of the hi and lo halves of the product
+ *   PK_FORMAT   printf conversion of PK_HALF, e.g. "%" PRIu32
+ *
+ * defined; they are undefined again at the end.
+ */
+
+#if !defined(PK_NAME) || !defined(PK_FLOAT) || !defined(PK_BITS) || \
+  !defined(PK_MUL) || !defined(PK_WIDE) || !defined(PK_HALF) || \
+  !defined(PK_FORMAT)
+#error "precision_template.h needs PK_NAME, PK_FLOAT, PK_BITS, PK_MUL, PK_WIDE, PK_HALF and PK_FORMAT"
+#endif
+
+
+static inline PK_BITS
+PK_FN(pk_transmute)(const PK_FLOAT x)
+{
+  PK_BITS bits;
+  memcpy(&bits, &x, sizeof(bits));
+  return bits;
+}
+
+
+static inline PK_FLOAT
+PK_FN(pk_untransmute)(const PK_BITS bits)
+{
+  PK_FLOAT x;
+  memcpy(&x, &bits, sizeof(x));
+  return x;
+}
+
+
+void
+PK_FN(pk_gen_block)(const PK_FLOAT low, const PK_FLOAT step_size,
+		    const size_t start, const size_t count, PK_FLOAT *output)
+{
+  assert(output != NULL);
+
+  for (size_t i=0; i<count; i++) {
+    output[i] = low + ((start+i)*step_size);
+  }
+}
+
+
+void
+PK_FN(pk_map_block)(double (*func)(double), const size_t count,
+		    const PK_FLOAT *input, PK_FLOAT *output)
+{
+  assert(func != NULL);
+  assert(input != NULL);
+  assert(output != NULL);
+
+  for (size_t i=0; i<count; i++) {
+    output[i] = func(input[i]);
+  }
+}
+
+
+void
+PK_FN(pk_faults_block)(const size_t start, const size_t count,
+		       const PK_FLOAT *input,
+		       const size_t fault_low_bit, const size_t fault_high_bit,
+		       fault_sampler *sampler,
+		       PK_FLOAT *output, char *fault_locations)
+{
+  assert(input != NULL);
+  assert(fault_low_bit <= fault_high_bit);
+  assert(fault_high_bit < 8*sizeof(PK_FLOAT));
+  assert(sampler != NULL);
+  assert(output != NULL);
+  assert(fault_locations != NULL);
+
+  memcpy(output, input, count*sizeof(PK_FLOAT));
+  memset(fault_locations, -1, count*sizeof(char));
+
+  while (sampler->next < start+count) {
+    assert(sampler->next >= start);
+    size_t target_entry = sampler->next - start;
+    size_t target_bit = rand_size(fault_low_bit, fault_high_bit);
+
+    PK_BITS hex = PK_FN(pk_transmute)(input[target_entry]);
+    hex ^= (PK_BITS) 1<<target_bit;
+    output[target_entry] = PK_FN(pk_untransmute)(hex);
+
+    fault_locations[target_entry] = target_bit;
+    fault_sampler_advance(sampler);
+  }
+}
+
+
+static inline void
+PK_FN(pk_split_product)(const PK_WIDE product, PK_HALF *hi, PK_HALF *lo)
+{
+  *hi = (PK_HALF) (product >> (8*sizeof(PK_HALF)));
+  *lo = (PK_HALF) product;
+}
+
+
+void
+PK_FN(pk_split_block)(const size_t count, const PK_FLOAT *input,
+		      const PK_MUL m, PK_HALF *hi, PK_HALF *lo)
+{
+  assert(input != NULL);
+  assert(hi != NULL);
+  assert(lo != NULL);
+
+  for (size_t i=0; i<count; i++) {
+    PK_WIDE product = (PK_WIDE) PK_FN(pk_transmute)(input[i]) * m;
+    PK_FN(pk_split_product)(product, &(hi[i]), &(lo[i]));
+  }
+}
+
+
+/* The step between two inputs, computed at this precision. Returned as a
+ * double, which holds every PK_FLOAT exactly.
+ */
+double
+PK_FN(pk_step_size)(const double low, const double high, const uint64_t steps)
+{
+  assert(steps > 0);
+
+  PK_FLOAT difference = (PK_FLOAT) high - (PK_FLOAT) low;
+  return (double) (difference/steps);
+}
+
+
+/* pk_gen_block and pk_map_block for entries start..start+count-1, with the
+ * resulting x widened to double
+ */
+void
+PK_FN(pk_points_block)(double (*func)(double), const double low,
+		       const double step_size, const size_t start,
+		       const size_t count, double *x)
+{
+  assert(func != NULL);
+  assert(x != NULL);
+
+  PK_FLOAT low_p = (PK_FLOAT) low;
+  PK_FLOAT step_size_p = (PK_FLOAT) step_size;
+  for (size_t i=0; i<count; i++) {
+    PK_FLOAT input = low_p + ((start+i)*step_size_p);
+    x[i] = (double) (PK_FLOAT) func(input);
+  }
+}
+
+
+/**
+ * pk_flip_bits: The clean hi/lo of x and the faulty hi/lo after flipping
+ *     each bit from fault_low_bit to fault_high_bit in turn, one outcome
+ *     per bit.
+ *
+ * Requires: - x holds a PK_FLOAT exactly, as from pk_points_block
+ *           - m fits in PK_MUL
+ *           - fault_high_bit < bits in PK_FLOAT
+ *           - outcomes has fault_high_bit-fault_low_bit+1 entries
+ *
+ * Notes: - flipping bit 'bit' of transmute(x) changes it by +-2^bit, so
+ *          the product changes by exactly +-(m << bit); the faulty hi/lo
+ *          come from the clean product without transmuting or
+ *          multiplying again
+ *
+ */
+void
+PK_FN(pk_flip_bits)(const double x, const uint64_t m,
+		    const size_t fault_low_bit, const size_t fault_high_bit,
+		    pk_outcome *outcomes)
+{
+  assert(m == (PK_MUL) m);
+  assert(fault_low_bit <= fault_high_bit);
+  assert(fault_high_bit < 8*sizeof(PK_FLOAT));
+  assert(outcomes != NULL);
+
+  PK_BITS hex = PK_FN(pk_transmute)((PK_FLOAT) x);
+  PK_WIDE product = (PK_WIDE) hex * (PK_MUL) m;
+  PK_HALF y_hi, y_lo;
+  PK_FN(pk_split_product)(product, &y_hi, &y_lo);
+
+  for (size_t bit=fault_low_bit; bit<=fault_high_bit; bit++) {
+    PK_WIDE shifted = (PK_WIDE) m << bit;
+    PK_WIDE faulty = ((hex >> bit) & 1) ? product - shifted : product + shifted;
+    PK_HALF yp_hi, yp_lo;
+    PK_FN(pk_split_product)(faulty, &yp_hi, &yp_lo);
+
+    pk_outcome *outcome = &(outcomes[bit-fault_low_bit]);
+    outcome->y_hi = y_hi;
+    outcome->yp_hi = yp_hi;
+    outcome->y_lo = y_lo;
+    outcome->yp_lo = yp_lo;
+  }
+}
+
+
+/* One chunk of rows, all arrays of 'count' entries */
+typedef struct PK_FN(_pk_chunk) {
+  size_t count;
+  const PK_FLOAT *input;
+  const PK_FLOAT *x;
+  const PK_FLOAT *xp;
+  const char *fault_locations;
+  const PK_HALF *y_hi;
+  const PK_HALF *y_lo;
+  const PK_HALF *yp_hi;
+  const PK_HALF *yp_lo;
+} PK_FN(pk_chunk);
+
+typedef void (*PK_FN(pk_write_func))(const pk_config *config,
+				     async_writer *out,
+				     const PK_FN(pk_chunk) *chunk);
+
+
+/* One csv row per entry, prefixed by config->name unless it is NULL */
+void
+PK_FN(pk_write_csv)(const pk_config *config, async_writer *out,
+		    const PK_FN(pk_chunk) *chunk)
+{
+  assert(config != NULL);
+  assert(out != NULL);
+  assert(chunk != NULL);
+
+  for (size_t i=0; i<chunk->count; i++) {
+    if (config->name != NULL) {
+      async_writer_printf(out, "%s, ", config->name);
+    }
+    async_writer_printf(out, "%f, %f, %f, %d, " PK_FORMAT ", " PK_FORMAT
+			", " PK_FORMAT ", " PK_FORMAT "\n",
+			(double) chunk->input[i], (double) chunk->x[i],
+			(double) chunk->xp[i], chunk->fault_locations[i],
+			chunk->y_hi[i], chunk->yp_hi[i],
+			chunk->y_lo[i], chunk->yp_lo[i]);
+  }
+}
+
+
+void
+PK_FN(pk_write_columnar_header)(const pk_config *config, async_writer *out)
+{
+  assert(config != NULL);
+  assert(out != NULL);
+
+  pk_columnar_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, PK_COLUMNAR_MAGIC, sizeof(header.magic));
+  header.version = PK_COLUMNAR_VERSION;
+  header.float_bytes = sizeof(PK_FLOAT);
+  header.columns = PK_COLUMNAR_COLUMNS;
+  header.steps = config->steps;
+  header.chunk_size = config->chunk_size;
+  header.half_bytes = sizeof(PK_HALF);
+  async_writer_write(out, &header, sizeof(header));
+}
+
+
+void
+PK_FN(pk_write_columnar)(const pk_config *config, async_writer *out,
+			 const PK_FN(pk_chunk) *chunk)
+{
+  assert(config != NULL);
+  assert(out != NULL);
+  assert(chunk != NULL);
+
+  size_t count = chunk->count;
+  uint64_t rows = count;
+  async_writer_write(out, &rows, sizeof(rows));
+  async_writer_write(out, chunk->input, count*sizeof(PK_FLOAT));
+  async_writer_write(out, chunk->x, count*sizeof(PK_FLOAT));
+  async_writer_write(out, chunk->xp, count*sizeof(PK_FLOAT));
+  async_writer_write(out, chunk->fault_locations, count*sizeof(char));
+  async_writer_write(out, chunk->y_hi, count*sizeof(PK_HALF));
+  async_writer_write(out, chunk->yp_hi, count*sizeof(PK_HALF));
+  async_writer_write(out, chunk->y_lo, count*sizeof(PK_HALF));
+  async_writer_write(out, chunk->yp_lo, count*sizeof(PK_HALF));
+}
+
+
+/**
+ * pk_run: Runs the pipeline over blocks of at most config->chunk_size
+ *     steps, so memory use does not depend on config->steps. Each block is
+ *     handed to 'write', and stats tallies how often the faults show in
+ *     the hi and lo halves.
+ *
+ * Requires: - config->m fits in PK_MUL
+ *           - config->fault_high_bit < bits in PK_FLOAT
+ *
+ * Ensures: - exactly config->fault_count rows are tainted
+ *
+ * Notes: - faults are drawn from rand(), so seeding it the same way before
+ *          every precision taints the same entries at the same bits
+ *
+ */
+void
+PK_FN(pk_run)(const pk_config *config, async_writer *out,
+	      PK_FN(pk_write_func) write, pk_stats *stats)
+{
+  assert(config != NULL);
+  assert(out != NULL);
+  assert(write != NULL);
+  assert(stats != NULL);
+  assert(config->low < config->high);
+  assert(config->chunk_size > 0);
+  assert(config->fault_count <= config->steps);
+  assert(config->m == (PK_MUL) config->m);
+
+  const size_t chunk_size = config->chunk_size;
+  const PK_MUL m = (PK_MUL) config->m;
+  PK_FLOAT *input = malloc(chunk_size*sizeof(PK_FLOAT));
+  PK_FLOAT *x = malloc(chunk_size*sizeof(PK_FLOAT));
+  PK_FLOAT *xp = malloc(chunk_size*sizeof(PK_FLOAT));
+  char *fault_locations = malloc(chunk_size*sizeof(char));
+  PK_HALF *y_hi = malloc(chunk_size*sizeof(PK_HALF));
+  PK_HALF *y_lo = malloc(chunk_size*sizeof(PK_HALF));
+  PK_HALF *yp_hi = malloc(chunk_size*sizeof(PK_HALF));
+  PK_HALF *yp_lo = malloc(chunk_size*sizeof(PK_HALF));
+  assert(input != NULL && x != NULL && xp != NULL && fault_locations != NULL);
+  assert(y_hi != NULL && y_lo != NULL && yp_hi != NULL && yp_lo != NULL);
+
+  PK_FLOAT low = (PK_FLOAT) config->low;
+  PK_FLOAT high = (PK_FLOAT) config->high;
+  PK_FLOAT difference = high-low;
+  PK_FLOAT step_size = difference/config->steps;
+
+  fault_sampler sampler;
+  fault_sampler_init(&sampler, config->steps, config->fault_count);
+
+  memset(stats, 0, sizeof(*stats));
+  for (uint64_t start=0; start<config->steps; start+=chunk_size) {
+    size_t count = (config->steps-start < chunk_size) ?
+      config->steps-start : chunk_size;
+
+    PK_FN(pk_gen_block)(low, step_size, start, count, input);
+    PK_FN(pk_map_block)(config->func, count, input, x);
+    PK_FN(pk_faults_block)(start, count, x, config->fault_low_bit,
+			   config->fault_high_bit, &sampler, xp,
+			   fault_locations);
+    PK_FN(pk_split_block)(count, x, m, y_hi, y_lo);
+    PK_FN(pk_split_block)(count, xp, m, yp_hi, yp_lo);
+
+    PK_FN(pk_chunk) chunk = {count, input, x, xp, fault_locations,
+			     y_hi, y_lo, yp_hi, yp_lo};
+    write(config, out, &chunk);
+
+    for (size_t i=0; i<count; i++) {
+      int tainted = (fault_locations[i] != -1);
+      int hi_changed = (y_hi[i] != yp_hi[i]);
+      int lo_changed = (y_lo[i] != yp_lo[i]);
+      stats->tainted += tainted;
+      stats->hi_changed += hi_changed;
+      stats->lo_changed += lo_changed;
+      stats->undetected += (tainted && !hi_changed && !lo_changed);
+    }
+    stats->rows += count;
+  }
+
+  free(input);
+  free(x);
+  free(xp);
+  free(fault_locations);
+  free(y_hi);
+  free(y_lo);
+  free(yp_hi);
+  free(yp_lo);
+}
+
+
+/* pk_run with csv rows, no header */
+void
+PK_FN(pk_run_csv)(const pk_config *config, async_writer *out, pk_stats *stats)
+{
+  PK_FN(pk_run)(config, out, PK_FN(pk_write_csv), stats);
+}
+
+
+/* pk_run with a columnar header and its blocks */
+void
+PK_FN(pk_run_columnar)(const pk_config *config, async_writer *out,
+		       pk_stats *stats)
+{
+  PK_FN(pk_write_columnar_header)(config, out);
+  PK_FN(pk_run)(config, out, PK_FN(pk_write_columnar), stats);
+}
+
+
+#undef PK_NAME
+#undef PK_FLOAT
+#undef PK_BITS
+#undef PK_MUL
+#undef PK_WIDE
+#undef PK_HALF
+#undef PK_FORMAT
@@ -0,0 +1,271 @@
+#ifndef VARINT_FEATURES_H
+#define VARINT_FEATURES_H
+
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+
+/* Compact binary encoding of feature files.
+ *
+ * A file is a varint_header followed by records. Each record is a flag byte
+ * followed by 'features' zigzag varints. Values are delta coded against the
+ * previous record in the file (the neighbouring L*L window of the same row
+ * of tiles) unless VARINT_FLAG_RESET is set, in which case they are delta
+ * coded against zero. Deltas are taken modulo 2^32 so any int32_t value,
+ * including the bits of a float, round trips exactly.
+ */
+
+#define VARINT_MAX_FEATURES 256
+#define VARINT_MAX_RECORD(features) (1 + 5*(features))
+
+static const char VARINT_MAGIC[4] = {'H', 'L', 'V', 'Z'};
+static const uint32_t VARINT_VERSION = 1;
+
+static const uint8_t VARINT_FLAG_NEGATIVE = 1<<0;
+static const uint8_t VARINT_FLAG_RESET = 1<<1;
+
+typedef enum _varint_kind {
+  VARINT_KIND_INT32 = 0,
+  VARINT_KIND_FLOAT_BITS = 1
+} varint_kind;
+
+typedef struct _varint_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t features;
+  uint32_t tiles_per_row;
+  uint32_t kind;
+} varint_header;
+
+typedef struct _varint_state {
+  uint32_t features;
+  int32_t prev[VARINT_MAX_FEATURES];
+} varint_state;
+
+
+uint32_t
+zigzag_encode(const int32_t x)
+{
+  return ((uint32_t) x << 1) ^ (uint32_t) -(int32_t) ((uint32_t) x >> 31);
+}
+
+
+int32_t
+zigzag_decode(const uint32_t x)
+{
+  return (int32_t) ((x >> 1) ^ -(x & 1));
+}
+
+
+/* Writes x as an LEB128 varint (1 to 5 bytes), returns the bytes used */
+size_t
+varint_put(uint32_t x, uint8_t *out)
+{
+  size_t len = 0;
+  while (x >= 0x80) {
+    out[len++] = (uint8_t) (x | 0x80);
+    x >>= 7;
+  }
+  out[len++] = (uint8_t) x;
+  return len;
+}
+
+
+void
+varint_state_init(varint_state *state, const uint32_t features)
+{
+  assert(state != NULL);
+  assert(features > 0 && features <= VARINT_MAX_FEATURES);
+
+  state->features = features;
+  memset(state->prev, 0, sizeof(state->prev));
+}
+
+
+void
+varint_make_header(varint_header *header, const uint32_t features,
+		   const uint32_t tiles_per_row, const varint_kind kind)
+{
+  assert(header != NULL);
+
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, VARINT_MAGIC, sizeof(header->magic));
+  header->version = VARINT_VERSION;
+  header->features = features;
+  header->tiles_per_row = tiles_per_row;
+  header->kind = kind;
+}
+
+
+int
+varint_check_header(const varint_header *header)
+{
+  assert(header != NULL);
+
+  return memcmp(header->magic, VARINT_MAGIC, sizeof(header->magic)) == 0 &&
+    header->version == VARINT_VERSION &&
+    header->features > 0 && header->features <= VARINT_MAX_FEATURES;
+}
+
+
+/**
+ * varint_encode_record: Encodes one labelled feature vector into 'out'
+ *
+ * Requires: - state was initialised with varint_state_init
+ *           - values holds state->features values
+ *           - out has room for VARINT_MAX_RECORD(state->features) bytes
+ *
+ * Ensures: - returns the number of bytes written
+ *          - state->prev holds 'values' for the next record
+ *
+ */
+size_t
+varint_encode_record(varint_state *state, const int example_type,
+		     const int reset, const int32_t *values, uint8_t *out)
+{
+  assert(state != NULL);
+  assert(values != NULL);
+  assert(out != NULL);
+  assert(example_type == 1 || example_type == -1);
+
+  if (reset) {
+    memset(state->prev, 0, state->features*sizeof(int32_t));
+  }
+
+  size_t len = 0;
+  out[len++] = ((example_type == -1) ? VARINT_FLAG_NEGATIVE : 0) |
+    (reset ? VARINT_FLAG_RESET : 0);
+  for (size_t i=0; i<state->features; i++) {
+    int32_t delta = (int32_t) ((uint32_t) values[i] - (uint32_t) state->prev[i]);
+    len += varint_put(zigzag_encode(delta), out+len);
+    state->prev[i] = values[i];
+  }
+
+  return len;
+}
+
+
+/* Reads one varint with no bounds checks, the caller guarantees 5 bytes */
+static inline uint32_t
+varint_get_fast(const uint8_t **in)
+{
+  const uint8_t *p = *in;
+  uint32_t x = p[0] & 0x7f;
+  if (p[0] < 0x80) { *in = p+1; return x; }
+  x |= (uint32_t) (p[1] & 0x7f) << 7;
+  if (p[1] < 0x80) { *in = p+2; return x; }
+  x |= (uint32_t) (p[2] & 0x7f) << 14;
+  if (p[2] < 0x80) { *in = p+3; return x; }
+  x |= (uint32_t) (p[3] & 0x7f) << 21;
+  if (p[3] < 0x80) { *in = p+4; return x; }
+  x |= (uint32_t) p[4] << 28;
+  *in = p+5;
+  return x;
+}
+
+
+/* Bounds checked varint read, returns 0 if 'end' is reached first */
+static inline int
+varint_get_checked(const uint8_t **in, const uint8_t *end, uint32_t *out)
+{
+  const uint8_t *p = *in;
+  uint32_t x = 0;
+  for (unsigned shift=0; shift<35; shift+=7) {
+    if (p == end) {
+      return 0;
+    }
+    uint8_t byte = *p++;
+    x |= (uint32_t) (byte & 0x7f) << shift;
+    if (byte < 0x80) {
+      *in = p;
+      *out = x;
+      return 1;
+    }
+  }
+  assert(0);
+  return 0;
+}
+
+
+/**
+ * varint_decode_block: Decodes as many whole records as fit in 'len' bytes
+ *     of 'in', up to 'max_records'
+ *
+ * Requires: - state was initialised with varint_state_init and has seen
+ *             every previous record of the stream
+ *           - labels has room for max_records entries
+ *           - values has room for max_records*state->features entries
+ *           - consumed is a valid *size_t
+ *
+ * Ensures: - returns the number of records decoded
+ *          - *consumed is the number of bytes they used, a partial record
+ *            at the end of the block is left for the next call
+ *
+ */
+size_t
+varint_decode_block(varint_state *state, const uint8_t *in, const size_t len,
+		    const size_t max_records, int8_t *labels, int32_t *values,
+		    size_t *consumed)
+{
+  assert(state != NULL);
+  assert(in != NULL || len == 0);
+  assert(labels != NULL);
+  assert(values != NULL);
+  assert(consumed != NULL);
+
+  const size_t features = state->features;
+  const uint8_t *p = in;
+  const uint8_t *end = in + len;
+  size_t records = 0;
+
+  while (records < max_records && p < end) {
+    uint8_t flags = *p;
+    int32_t *out = values + records*features;
+
+    if ((size_t) (end - p) >= VARINT_MAX_RECORD(features)) {
+      if (flags & VARINT_FLAG_RESET) {
+	memset(state->prev, 0, features*sizeof(int32_t));
+      }
+      const uint8_t *q = p+1;
+      for (size_t i=0; i<features; i++) {
+	uint32_t delta = (uint32_t) zigzag_decode(varint_get_fast(&q));
+	out[i] = (int32_t) ((uint32_t) state->prev[i] + delta);
+	state->prev[i] = out[i];
+      }
+      p = q;
+    } else {
+      // near the end of the block, decode into a copy so a partial record
+      // leaves state untouched
+      int32_t prev[VARINT_MAX_FEATURES];
+      if (flags & VARINT_FLAG_RESET) {
+	memset(prev, 0, features*sizeof(int32_t));
+      } else {
+	memcpy(prev, state->prev, features*sizeof(int32_t));
+      }
+      const uint8_t *q = p+1;
+      size_t i;
+      for (i=0; i<features; i++) {
+	uint32_t zz;
+	if (!varint_get_checked(&q, end, &zz)) {
+	  break;
+	}
+	prev[i] = (int32_t) ((uint32_t) prev[i] + (uint32_t) zigzag_decode(zz));
+      }
+      if (i < features) {
+	break;
+      }
+      memcpy(out, prev, features*sizeof(int32_t));
+      memcpy(state->prev, prev, features*sizeof(int32_t));
+      p = q;
+    }
+
+    labels[records] = (flags & VARINT_FLAG_NEGATIVE) ? -1 : 1;
+    records++;
+  }
+
+  *consumed = p - in;
+  return records;
+}
+
+
+#endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <math.h>
 #include <stdint.h>
@@ -11,6 +12,10 @@
 #include <time.h>
 
 #include "mul_hi_lo.h"
+#include "async_writer.h"
+#include "varint_features.h"
+#include "placement.h"
+#include "feature_stream.h"
 
 static const int BITS_IN_FLOAT=32;
 
@@ -26,12 +31,11 @@ typedef double (*Class2Func)(double);
 static const size_t NUM_FUNCTIONS = 2;
 static Class2Func FUNCTIONS[] = {&sin, &cos};
 
-float *
-gen_input(const float low, const float high, const size_t steps)
+void
+gen_input_into(const float low, const float high, const size_t steps,
+	       float *output)
 {
   assert(low < high);
-
-  float * output = malloc(steps*sizeof(float));
   assert(output != NULL);
 
   float difference = high-low;
@@ -40,6 +44,18 @@ gen_input(const float low, const float high, const size_t steps)
   for (size_t i=0; i<steps; i++) {
     output[i] = low + (i*step_size);
   }
+}
+
+
+float *
+gen_input(const float low, const float high, const size_t steps)
+{
+  assert(low < high);
+
+  float * output = malloc(steps*sizeof(float));
+  assert(output != NULL);
+
+  gen_input_into(low, high, steps, output);
 
   return output;
 }
@@ -62,19 +78,31 @@ gen_2d_input(const float low, const float high, const size_t x, const size_t y)
 }
 
 
-float *
-map_func(const size_t func_choice, const size_t steps, const float *input)
+void
+map_func_into(const size_t func_choice, const size_t steps, const float *input,
+	      float *output)
 {
   assert(func_choice < NUM_FUNCTIONS);
   assert(input != NULL);
-
-  float *output = malloc(steps * sizeof(float));
   assert(output != NULL);
 
   Class2Func func = FUNCTIONS[func_choice];
   for (size_t i=0; i<steps; i++) {
     output[i] = func(input[i]);
   }
+}
+
+
+float *
+map_func(const size_t func_choice, const size_t steps, const float *input)
+{
+  assert(func_choice < NUM_FUNCTIONS);
+  assert(input != NULL);
+
+  float *output = malloc(steps * sizeof(float));
+  assert(output != NULL);
+
+  map_func_into(func_choice, steps, input, output);
 
   return output;
 }
@@ -97,6 +125,107 @@ map_2d_func(const size_t func_choice, const size_t x, const size_t y,
 }
 
 
+/* map_2d_func of rows [row_start, row_end) only, the other rows are NULL */
+float**
+map_2d_func_rows(const size_t func_choice, const size_t x, const size_t y,
+		 const float **input, const size_t row_start,
+		 const size_t row_end)
+{
+  assert(input != NULL);
+  assert(row_start <= row_end && row_end <= x);
+
+  float **output = calloc(x, sizeof(float*));
+  assert(output != NULL);
+
+  for (size_t index=row_start; index<row_end; index++) {
+    output[index] = map_func(func_choice, y, input[index]);
+  }
+
+  return output;
+}
+
+
+/**
+ * map_2d_func_toeplitz: map_2d_func(func_choice, A, A, gen_2d_input(low,
+ *     high, A, A)) without the A*A function calls
+ *
+ * Rows of a square gen_2d_input field are shifted by one step per row, the
+ * same step as along a row, so input[i][j] depends on j - i alone up to
+ * float rounding. Rounding makes each diagonal alternate between a handful
+ * of neighbouring floats, so every one of the 2A-1 diagonals keeps the last
+ * TOEPLITZ_WAYS inputs it saw and func of them. An entry whose input has the
+ * same bits as one of them reuses the value, any other entry is evaluated
+ * and replaces the oldest. Inputs are recomputed with gen_input_into, so the
+ * result is bit identical to the plain path and the function is called
+ * O(A) times.
+ *
+ * Ensures: - *evaluations is the number of func calls made
+ *
+ */
+#define TOEPLITZ_WAYS 8
+
+float **
+map_2d_func_toeplitz(const size_t func_choice, const float low,
+		     const float high, const size_t A, size_t *evaluations)
+{
+  assert(func_choice < NUM_FUNCTIONS);
+  assert(low < high);
+  assert(A > 0);
+  assert(evaluations != NULL);
+
+  Class2Func func = FUNCTIONS[func_choice];
+  size_t diagonals = 2*A-1;
+  int32_t *keys = malloc(diagonals*TOEPLITZ_WAYS*sizeof(int32_t));
+  float *values = malloc(diagonals*TOEPLITZ_WAYS*sizeof(float));
+  unsigned char *used = calloc(diagonals, sizeof(unsigned char));
+  float *row = malloc(A*sizeof(float));
+  float **output = malloc(A*sizeof(float*));
+  assert(keys != NULL && values != NULL && used != NULL);
+  assert(row != NULL && output != NULL);
+
+  // identical arithmetic to gen_2d_input
+  float difference = high-low;
+  float step_size = difference/A;
+
+  size_t calls = 0;
+  for (size_t index=0; index<A; index++) {
+    gen_input_into(low-(step_size*index), high-(step_size*index), A, row);
+    output[index] = malloc(A*sizeof(float));
+    assert(output[index] != NULL);
+
+    for (size_t j=0; j<A; j++) {
+      size_t diagonal = j + (A-1) - index;
+      int32_t *way_keys = &(keys[diagonal*TOEPLITZ_WAYS]);
+      float *way_values = &(values[diagonal*TOEPLITZ_WAYS]);
+      size_t ways = (used[diagonal] < TOEPLITZ_WAYS) ? used[diagonal] : TOEPLITZ_WAYS;
+      int32_t key = transmute(row[j]);
+
+      size_t way = 0;
+      while (way < ways && way_keys[way] != key) {
+	way++;
+      }
+      if (way == ways) {
+	way = used[diagonal] % TOEPLITZ_WAYS;
+	way_keys[way] = key;
+	way_values[way] = func(row[j]);
+	// wraps from 2*TOEPLITZ_WAYS-1 back to TOEPLITZ_WAYS, staying full
+	used[diagonal] = (used[diagonal]+1 < 2*TOEPLITZ_WAYS) ?
+	  used[diagonal]+1 : TOEPLITZ_WAYS;
+	calls++;
+      }
+      output[index][j] = way_values[way];
+    }
+  }
+
+  free(keys);
+  free(values);
+  free(used);
+  free(row);
+  *evaluations = calls;
+  return output;
+}
+
+
 
 
 
@@ -200,6 +329,85 @@ insert_full_faults(const size_t A, float **input, size_t H,
 }
 
 
+/* insert_2d_faults on a field_view, drawing the same random numbers in the
+ * same order, so a view of a field receives the same faults as its rows
+ */
+void
+insert_2d_faults_view(const field_view *view, size_t H,
+		      const size_t fault_low_bit, const size_t fault_high_bit,
+		      const uint64_t fault_count, const size_t x, const size_t y)
+{
+  assert(view != NULL);
+  assert(view->extent_x == view->extent_y);
+
+  size_t grid_width = view->extent_x/H;
+  for (size_t tries=0; tries < fault_count; tries++) {
+    size_t xi = rand_size(grid_width*x, grid_width*(x+1)-1);
+    size_t yi = rand_size(grid_width*y, grid_width*(y+1)-1);
+    size_t target_bit = rand_size(fault_low_bit, fault_high_bit);
+
+    float *entry = field_view_at(view, xi, yi);
+    int32_t hex = transmute(*entry);
+    hex ^= (uint32_t) 1<<target_bit;
+    *entry = untransmute(hex);
+  }
+}
+
+
+void
+insert_full_faults_view(const field_view *view, size_t H,
+			const size_t fault_low_bit, const size_t fault_high_bit,
+			const uint64_t fault_count)
+{
+  size_t flts = fault_count / (H*H);
+  for (size_t x=0; x<H; x++) {
+    for (size_t y=0; y<H; y++) {
+      insert_2d_faults_view(view, H, fault_low_bit, fault_high_bit, flts, x, y);
+    }
+  }
+}
+
+
+/* rand() seed of tile x*H + y for a given --seed (splitmix64 finalizer) */
+unsigned int
+tile_seed(const uint64_t seed, const size_t tile)
+{
+  uint64_t z = seed + (tile+1)*0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return (unsigned int) (z ^ (z >> 31));
+}
+
+
+/* insert_full_faults (or insert_full_faults_view when view is not NULL) for
+ * tiles [first_tile, end_tile) only, with rand() reseeded from 'seed' before
+ * every tile. A tile's faults then depend on the seed and the tile alone, so
+ * any split of the tiles between processes corrupts them the same way.
+ */
+void
+insert_tile_faults(const size_t A, float **input, const field_view *view,
+		   size_t H, const size_t fault_low_bit,
+		   const size_t fault_high_bit, const uint64_t fault_count,
+		   const uint64_t seed, const size_t first_tile,
+		   const size_t end_tile)
+{
+  assert(input != NULL || view != NULL);
+  assert(first_tile <= end_tile && end_tile <= H*H);
+
+  size_t flts = fault_count / (H*H);
+  for (size_t tile=first_tile; tile<end_tile; tile++) {
+    srand(tile_seed(seed, tile));
+    if (view != NULL) {
+      insert_2d_faults_view(view, H, fault_low_bit, fault_high_bit, flts,
+			    tile/H, tile%H);
+    } else {
+      insert_2d_faults(A, input, H, fault_low_bit, fault_high_bit, flts,
+		       tile/H, tile%H);
+    }
+  }
+}
+
+
 /********************************************************************************
  * L1 NORM CALCULATION                                                          *
  *******************************************************************************/
@@ -247,204 +455,2262 @@ calc_2d_norm(const size_t A, const float **full_array, const size_t grids)
 }
 
 
+/* calc_2d_norm of the rows of tiles [grid_start, grid_end) only, the other
+ * rows are NULL and only the field rows under these tiles are read
+ */
+float**
+calc_2d_norm_rows(const size_t A, const float **full_array, const size_t grids,
+		  const size_t grid_start, const size_t grid_end)
+{
+  assert(full_array != NULL);
+  assert(grid_start <= grid_end && grid_end <= grids);
 
+  float **output = calloc(grids, sizeof(float*));
+  assert(output != NULL);
 
+  for (size_t ix=grid_start; ix < grid_end; ix++) {
+    output[ix] = malloc(grids*sizeof(float));
+    assert(output[ix] != NULL);
 
+    for (size_t iy=0; iy < grids; iy++) {
+      output[ix][iy] = calc_norm(A, full_array, grids, ix, iy);
+    }
+  }
 
-/********************************************************************************
- * FEATURE VECTOR CREATION                                                      *
- *******************************************************************************/
-char *original_file;
-char *high_file;
-char *low_file;
-void
-print_features(int example_type, size_t grids, const float **norms, size_t H, int32_t m)
-{
-  assert(example_type == 1 || example_type == -1);
+  return output;
+}
 
 
-  int32_t **y_hi = malloc(grids * sizeof(int32_t*)); assert(y_hi!=NULL);
-  int32_t **y_lo = malloc(grids * sizeof(int32_t*)); assert(y_lo!=NULL);
-  for (size_t x=0; x<grids; x++) {
-    for (size_t y=0; y<grids; y++) {
-      y_hi[x] = malloc(grids * sizeof(int32_t)); assert(y_hi[x]!=NULL);
-      y_lo[x] = malloc(grids * sizeof(int32_t)); assert(y_lo[x]!=NULL);
-    }
-  }
-  split_2d_array(grids, grids, norms, m,  &y_hi, &y_lo);
+/* calc_2d_norm on a field_view of an A by A field.
+ *
+ * Field rows are consumed in order, a row of tiles at a time, each row added
+ * to the running sums of its grids tiles, so every tile sums its entries in
+ * calc_norm's order and the norms are bit identical. Rows that are not
+ * unit-stride along y are first gathered VIEW_BLOCK at a time into a local
+ * buffer, walking each column of the block along x (unit-stride for
+ * column-major data).
+ */
+float**
+calc_2d_norm_view(const field_view *view, const size_t grids)
+{
+  assert(view != NULL);
+  assert(view->extent_x == view->extent_y);
 
-  FILE *original_fp = fopen(original_file, "a");
-  FILE *high_fp = fopen(high_file, "a");
-  FILE *low_fp = fopen(low_file, "a");
+  const size_t A = view->extent_x;
+  assert(A%grids == 0);
+  size_t grid_width = A/grids;
 
-  for (size_t x=0; x<H; x++) {
-    for (size_t y=0; y<H; y++) {
-      fprintf(original_fp, "%s1 ", (example_type==1) ? "+" : "-");
-      int i=1;
-      for (size_t subx=x*L; subx<(x+1)*L; subx++) {
-	for (size_t suby=y*L; suby<(y+1)*L; suby++) {
-	  fprintf(original_fp, "%d:%f ", i++, norms[subx][suby]);
+  float **output = malloc(grids*sizeof(float*));
+  float *rows = malloc(VIEW_BLOCK*A*sizeof(float));
+  assert(output != NULL && rows != NULL);
+
+  for (size_t tx=0; tx < grids; tx++) {
+    float *sums = calloc(grids, sizeof(float));
+    assert(sums != NULL);
+    output[tx] = sums;
+
+    for (size_t x0=tx*grid_width; x0 < (tx+1)*grid_width; x0+=VIEW_BLOCK) {
+      size_t bx = ((tx+1)*grid_width - x0 < VIEW_BLOCK) ?
+	(tx+1)*grid_width - x0 : VIEW_BLOCK;
+      if (view->stride_y != 1) {
+	for (size_t y=0; y < A; y++) {
+	  const float *column = field_view_at(view, x0, y);
+	  for (size_t x=0; x < bx; x++) {
+	    rows[x*A + y] = column[x*view->stride_x];
+	  }
 	}
       }
-      fprintf(original_fp, "\n");
 
-      fprintf(high_fp, "%s1 ", (example_type==1) ? "+" : "-");
-      i=1;
-      for (size_t subx=x*L; subx<(x+1)*L; subx++) {
-	for (size_t suby=y*L; suby<(y+1)*L; suby++) {
-	  fprintf(high_fp, "%d:%d ", i++, y_hi[subx][suby]);
+      for (size_t x=0; x < bx; x++) {
+	const float *row = (view->stride_y == 1) ?
+	  field_view_at(view, x0+x, 0) : &(rows[x*A]);
+	for (size_t ty=0; ty < grids; ty++) {
+	  float sum = sums[ty];
+	  for (size_t y=ty*grid_width; y < (ty+1)*grid_width; y++) {
+	    sum += row[y];
+	  }
+	  sums[ty] = sum;
 	}
       }
-      fprintf(high_fp, "\n");
+    }
+  }
 
-      fprintf(low_fp, "%s1 ", (example_type==1) ? "+" : "-");
-      i=1;
-      for (size_t subx=x*L; subx<(x+1)*L; subx++) {
-	for (size_t suby=y*L; suby<(y+1)*L; suby++) {
-	  fprintf(low_fp, "%d:%d ", i++, y_lo[subx][suby]);
-	}
-      }
-      fprintf(low_fp, "\n");
+  free(rows);
+  return output;
+}
+
+
+/* Lays an A by A field out the way a solver stores it: row or column-major,
+ * inside 'halo' cells of zero padding on every side. Returns the view of
+ * the interior.
+ */
+field_view
+layout_field(const float **field, const size_t A, const int column_major,
+	     const size_t halo)
+{
+  assert(field != NULL);
+
+  size_t ld = A + 2*halo;
+  float *base = calloc(ld*ld, sizeof(float));
+  assert(base != NULL);
+
+  field_view padded = column_major ? field_view_col_major(base, ld, ld, ld) :
+    field_view_row_major(base, ld, ld, ld);
+  field_view view = field_view_sub(&padded, halo, halo+A, halo, halo+A);
+  for (size_t x=0; x<A; x++) {
+    for (size_t y=0; y<A; y++) {
+      *field_view_at(&view, x, y) = field[x][y];
     }
   }
-  fclose(original_fp);
-  fclose(high_fp);
-  fclose(low_fp);
+
+  return view;
 }
 
 
 
+
+
+
 /********************************************************************************
- * ARGUMENT PARSING                                                             *
+ * PLACED 2D STAGES: the same stages, run by pinned workers over row bands      *
  *******************************************************************************/
 
+/* Work is split in rows of tiles (units of A/grids field rows), so the worker
+ * that generates a band of the field is also the one that maps it and sums
+ * its norms, and every page is first touched on the node that uses it.
+ * With a NULL placement the stage_* functions fall back to the serial ones.
+ */
+typedef struct _stage_job {
+  size_t func_choice;
+  float low;
+  float high;
+  size_t A;
+  size_t grids;
+  const float **input;
+  float **output;
+} stage_job;
+
 
-unsigned long long
-get_unsigned_long_long(const char *in)
+float **
+alloc_placed_field(const size_t A)
 {
-  char * pt;
-  unsigned long long out = strtoull(in, &pt, 0);
-  if (errno == ERANGE ||
-      errno == EINVAL ||
-      in+strlen(in) != pt) {
-    assert(0);
+  float *base = placement_alloc(A*A*sizeof(float));
+  float **rows = malloc(A*sizeof(float*));
+  assert(rows != NULL);
+  for (size_t index=0; index<A; index++) {
+    rows[index] = base + index*A;
   }
-  return out;
+  return rows;
 }
 
 
-float
-get_float(const char *in)
+void
+gen_band(void *arg, size_t start, size_t end)
 {
-  char * pt;
-  float out = (float) strtod(in, &pt);
-  if (errno == ERANGE ||
-      errno == EINVAL ||
-      in+strlen(in) != pt) {
-    assert(0);
+  stage_job *job = arg;
+  size_t grid_width = job->A/job->grids;
+
+  // identical arithmetic to gen_2d_input
+  float difference = job->high-job->low;
+  float step_size = difference/job->A;
+  for (size_t index=start*grid_width; index<end*grid_width; index++) {
+    gen_input_into(job->low-(step_size*index), job->high-(step_size*index),
+		   job->A, job->output[index]);
   }
-  return out; 
 }
 
 
 void
-write_2d_int_array(const char *filename, const size_t x, const size_t y, 
-		   const int32_t **input)
+map_band(void *arg, size_t start, size_t end)
 {
-  assert(filename != NULL);
-  assert(input != NULL);
-
-  FILE *fp = fopen(filename, "w");
-  assert(fp != NULL);
+  stage_job *job = arg;
+  size_t grid_width = job->A/job->grids;
 
-  for (size_t x_index=0; x_index < x; x_index++) {
-    for (size_t y_index=0; y_index < y; y_index++) {
-      fprintf(fp, "%d, ", input[x_index][y_index]);
-    }
-    fprintf(fp,"\n");
+  for (size_t index=start*grid_width; index<end*grid_width; index++) {
+    map_func_into(job->func_choice, job->A, job->input[index],
+		  job->output[index]);
   }
-
-  fclose(fp);
 }
 
 
 void
-write_2d_float_array(const char *filename, const size_t x, const size_t y, 
-		     const float **input)
+norm_band(void *arg, size_t start, size_t end)
 {
-  assert(filename != NULL);
-  assert(input != NULL);
-
-  FILE *fp = fopen(filename, "w");
-  assert(fp != NULL);
+  stage_job *job = arg;
 
-  for (size_t x_index=0; x_index < x; x_index++) {
-    for (size_t y_index=0; y_index < y; y_index++) {
-      fprintf(fp, "%f, ", input[x][y]);
+  for (size_t ix=start; ix < end; ix++) {
+    for (size_t iy=0; iy < job->grids; iy++) {
+      job->output[ix][iy] = calc_norm(job->A, job->input, job->grids, ix, iy);
     }
-    fprintf(fp,"\n");
   }
-
-  fclose(fp);
 }
 
 
+float **
+stage_gen_2d_input(placement *pl, const float low, const float high,
+		   const size_t A, const size_t grids)
+{
+  if (pl == NULL) {
+    return gen_2d_input(low, high, A, A);
+  }
 
-int
-main(int argc, char **argv) 
+  stage_job job = {0, low, high, A, grids, NULL, alloc_placed_field(A)};
+  placement_run(pl, grids, gen_band, &job);
+  placement_report(pl, stderr, "input", job.output[0], A*A*sizeof(float), grids);
+  return job.output;
+}
+
+
+float **
+stage_map_2d_func(placement *pl, const size_t func_choice, const size_t A,
+		  const size_t grids, const float **input)
 {
-  srand(time(NULL));
-  assert(argc > 2);
-  char *mode = argv[1];
+  if (pl == NULL) {
+    return map_2d_func(func_choice, A, A, input);
+  }
 
-  if (strcmp(mode, "train") == 0) {
-    assert(argc == 14);
-    int i = 2;
-    size_t func_choice = get_unsigned_long_long(argv[i++]);
-    assert(func_choice < NUM_FUNCTIONS);
+  stage_job job = {func_choice, 0, 0, A, grids, input, alloc_placed_field(A)};
+  placement_run(pl, grids, map_band, &job);
+  placement_report(pl, stderr, "field", job.output[0], A*A*sizeof(float), grids);
+  return job.output;
+}
 
-    float low = get_float(argv[i++]);
-    float high = get_float(argv[i++]);
-    assert(low < high);
 
-    size_t H = get_unsigned_long_long(argv[i++]);
-    size_t grids = H*L;
-    assert(H%L == 0);
+float **
+stage_calc_2d_norm(placement *pl, const size_t A, const float **full_array,
+		   const size_t grids)
+{
+  if (pl == NULL) {
+    return calc_2d_norm(A, full_array, grids);
+  }
 
-    size_t A = get_unsigned_long_long(argv[i++]);
-    assert(A%grids == 0);
+  // one placed block like the fields, each row first written by its worker
+  float *base = placement_alloc(grids*grids*sizeof(float));
+  float **output = malloc(grids*sizeof(float*));
+  assert(output != NULL);
+  for (size_t ix=0; ix<grids; ix++) {
+    output[ix] = base + ix*grids;
+  }
+  stage_job job = {0, 0, 0, A, grids, full_array, output};
+  placement_run(pl, grids, norm_band, &job);
+  return output;
+}
 
-    size_t fault_low_bit = get_unsigned_long_long(argv[i++]);
-    size_t fault_high_bit = get_unsigned_long_long(argv[i++]);
-    assert(fault_low_bit <= fault_high_bit);
 
-    size_t fault_count = get_unsigned_long_long(argv[i++]);
 
-    int32_t m = get_unsigned_long_long(argv[i++]);
+/********************************************************************************
+ * 3D VOLUMES: contiguous A x A x A fields, entry (x, y, z) at (x*A + y)*A + z  *
+ *******************************************************************************/
 
-    original_file = argv[i++];
-    low_file = argv[i++];
-    high_file = argv[i++];
+/* Like gen_2d_input, each z run is a linspace whose range is shifted by
+ * step_size per step in x and in y
+ */
+float *
+gen_3d_input(const float low, const float high, const size_t A)
+{
+  float *output = malloc(A*A*A*sizeof(float));
+  assert(output != NULL);
 
-    const float **input = (const float**) gen_2d_input(low, high, A, A);
+  float difference = high-low;
+  float step_size = difference/A;
 
+  for (size_t x=0; x<A; x++) {
+    for (size_t y=0; y<A; y++) {
+      float shift = step_size*(x+y);
+      gen_input_into(low-shift, high-shift, A, &(output[(x*A + y)*A]));
+    }
+  }
 
-    // Clean data
-    const float **x = (const float**) map_2d_func(func_choice, A, A, input);    
+  return output;
+}
 
-    const float **norms = (const float**) calc_2d_norm(A, x, grids);
 
-    print_features(1, grids, norms, H, m);
+float *
+map_3d_func(const size_t func_choice, const size_t A, const float *input)
+{
+  return map_func(func_choice, A*A*A, input);
+}
 
-    //Corrupted
-    float **corrupt_x = map_2d_func(func_choice, A, A, input);    
-    insert_full_faults(A, corrupt_x, H, fault_low_bit, fault_high_bit, 
-		       fault_count);
-    const float **corrupt_norms = (const float**) calc_2d_norm(A, (const float**)corrupt_x, grids);
-    print_features(-1, grids, corrupt_norms, H, m);
 
-    return 0;
-    
+void
+insert_3d_faults(const size_t A, float *input, size_t H,
+		 const size_t fault_low_bit, const size_t fault_high_bit,
+		 const uint64_t fault_count,
+		 const size_t x, const size_t y, const size_t z)
+{
+  size_t grid_width = A/H;
+  for (size_t tries=0; tries < fault_count; tries++) {
+    size_t xi = rand_size(grid_width*x, grid_width*(x+1)-1);
+    size_t yi = rand_size(grid_width*y, grid_width*(y+1)-1);
+    size_t zi = rand_size(grid_width*z, grid_width*(z+1)-1);
+    size_t target_bit = rand_size(fault_low_bit, fault_high_bit);
+
+    size_t index = (xi*A + yi)*A + zi;
+    int32_t hex = transmute(input[index]);
+    hex ^= (uint32_t) 1<<target_bit;
+    input[index] = untransmute(hex);
+  }
+}
+
+
+void
+insert_full_3d_faults(const size_t A, float *input, size_t H,
+		      const size_t fault_low_bit, const size_t fault_high_bit,
+		      const uint64_t fault_count)
+{
+  size_t flts = fault_count / (H*H*H);
+  for (size_t x=0; x<H; x++) {
+    for (size_t y=0; y<H; y++) {
+      for (size_t z=0; z<H; z++) {
+	insert_3d_faults(A, input, H, fault_low_bit, fault_high_bit, flts,
+			 x, y, z);
+      }
+    }
+  }
+}
+
+
+/* L1 norms of the grids^3 tiles of a volume, as a contiguous grids^3 array.
+ *
+ * The volume is streamed once in memory order, one slab of grid_width x
+ * planes (a row of tiles) at a time, while the slab's grids*grids partial
+ * sums stay in L1. Every tile still receives its entries in (x, y, z)
+ * order, so the sums are those of a per tile triple loop, bit for bit,
+ * without its strided walk over A*A sized planes.
+ */
+float *
+calc_3d_norm(const size_t A, const float *volume, const size_t grids)
+{
+  assert(volume != NULL);
+  assert(A%grids == 0);
+
+  size_t grid_width = A/grids;
+  float *output = calloc(grids*grids*grids, sizeof(float));
+  assert(output != NULL);
+
+  for (size_t tx=0; tx<grids; tx++) {
+    float *slab_sums = &(output[tx*grids*grids]);
+    for (size_t x=tx*grid_width; x<(tx+1)*grid_width; x++) {
+      for (size_t y=0; y<A; y++) {
+	const float *row = &(volume[(x*A + y)*A]);
+	float *row_sums = &(slab_sums[(y/grid_width)*grids]);
+	for (size_t tz=0; tz<grids; tz++) {
+	  float sum = row_sums[tz];
+	  for (size_t z=tz*grid_width; z<(tz+1)*grid_width; z++) {
+	    sum += row[z];
+	  }
+	  row_sums[tz] = sum;
+	}
+      }
+    }
+  }
+
+  return output;
+}
+
+
+
+/********************************************************************************
+ * FEATURE VECTOR CREATION                                                      *
+ *******************************************************************************/
+async_writer *original_out;
+async_writer *high_out;
+async_writer *low_out;
+
+/* Feature files are either the original libsvm style text, or the compact
+ * varint encoding of varint_features.h (original features as float bits)
+ */
+typedef enum _feature_format {
+  FEATURES_TEXT,
+  FEATURES_VARINT
+} feature_format;
+
+feature_format features_format = FEATURES_TEXT;
+varint_state original_state;
+varint_state high_state;
+varint_state low_state;
+
+
+void
+print_varint_record(async_writer *out, varint_state *state, int example_type,
+		    int reset, const int32_t *values)
+{
+  uint8_t *space = (uint8_t *) async_writer_reserve(out,
+						     VARINT_MAX_RECORD(state->features));
+  size_t len = varint_encode_record(state, example_type, reset, values, space);
+  async_writer_commit(out, len);
+}
+
+
+/* Fused per H-tile kernel: each tile's L*L norms are read once, split into
+ * hi/lo in registers and written to all three feature files in the same
+ * pass, so no grids*grids hi/lo tables are ever materialised. When the
+ * planes are already known (clean feature cache) they are passed in as
+ * cached_hi/cached_lo and used instead of splitting. Only tiles x*H + y in
+ * [first_tile, end_tile) are written (a --shard), the norms of other tiles
+ * are never read.
+ */
+void
+print_features(int example_type, size_t grids, const float **norms, size_t H, int32_t m,
+	       const int32_t **cached_hi, const int32_t **cached_lo,
+	       size_t first_tile, size_t end_tile)
+{
+  assert(example_type == 1 || example_type == -1);
+  assert(norms != NULL);
+  assert(H*L <= grids);
+  assert(original_out != NULL);
+  assert(high_out != NULL);
+  assert(low_out != NULL);
+
+  const char *label = (example_type==1) ? "+1 " : "-1 ";
+  int32_t norm_bits[VARINT_MAX_FEATURES];
+  int32_t his[VARINT_MAX_FEATURES];
+  int32_t los[VARINT_MAX_FEATURES];
+
+  for (size_t x=0; x<H; x++) {
+    for (size_t y=0; y<H; y++) {
+      size_t tile = x*H + y;
+      if (tile < first_tile || tile >= end_tile) {
+	continue;
+      }
+
+      if (features_format == FEATURES_VARINT) {
+	size_t i=0;
+	for (size_t subx=x*L; subx<(x+1)*L; subx++) {
+	  for (size_t suby=y*L; suby<(y+1)*L; suby++) {
+	    norm_bits[i] = transmute(norms[subx][suby]);
+	    if (cached_hi != NULL) {
+	      his[i] = cached_hi[subx][suby];
+	      los[i] = cached_lo[subx][suby];
+	    } else {
+	      split_float(norms[subx][suby], m, &(his[i]), &(los[i]));
+	    }
+	    i++;
+	  }
+	}
+	// delta chains restart at the first tile of every row, and of a shard
+	int reset = (y == 0 || tile == first_tile);
+	print_varint_record(original_out, &original_state, example_type, reset,
+			    norm_bits);
+	print_varint_record(high_out, &high_state, example_type, reset, his);
+	print_varint_record(low_out, &low_state, example_type, reset, los);
+	continue;
+      }
+
+      async_writer_printf(original_out, "%s", label);
+      async_writer_printf(high_out, "%s", label);
+      async_writer_printf(low_out, "%s", label);
+
+      int i=1;
+      for (size_t subx=x*L; subx<(x+1)*L; subx++) {
+	for (size_t suby=y*L; suby<(y+1)*L; suby++) {
+	  float norm = norms[subx][suby];
+	  int32_t hi, lo;
+	  if (cached_hi != NULL) {
+	    hi = cached_hi[subx][suby];
+	    lo = cached_lo[subx][suby];
+	  } else {
+	    split_float(norm, m, &hi, &lo);
+	  }
+	  async_writer_printf(original_out, "%d:%f ", i, norm);
+	  async_writer_printf(high_out, "%d:%d ", i, hi);
+	  async_writer_printf(low_out, "%d:%d ", i, lo);
+	  i++;
+	}
+      }
+
+      async_writer_printf(original_out, "\n");
+      async_writer_printf(high_out, "\n");
+      async_writer_printf(low_out, "\n");
+    }
+  }
+}
+
+
+/* print_features for volumes: one record per L*L*L window of the H*H*H
+ * windows of a contiguous grids^3 norm volume, features in (x, y, z) order.
+ * hi/lo are the split of the whole norm volume (split_3d_array), which at
+ * one entry per tile is small next to the field.
+ */
+void
+print_3d_features(int example_type, size_t grids, const float *norms, size_t H,
+		  const int32_t *hi, const int32_t *lo)
+{
+  assert(example_type == 1 || example_type == -1);
+  assert(norms != NULL);
+  assert(hi != NULL);
+  assert(lo != NULL);
+  assert(H*L <= grids);
+  assert(L*L*L <= VARINT_MAX_FEATURES);
+
+  const char *label = (example_type==1) ? "+1 " : "-1 ";
+  int32_t norm_bits[VARINT_MAX_FEATURES];
+  int32_t his[VARINT_MAX_FEATURES];
+  int32_t los[VARINT_MAX_FEATURES];
+
+  for (size_t x=0; x<H; x++) {
+    for (size_t y=0; y<H; y++) {
+      for (size_t z=0; z<H; z++) {
+	if (features_format == FEATURES_TEXT) {
+	  async_writer_printf(original_out, "%s", label);
+	  async_writer_printf(high_out, "%s", label);
+	  async_writer_printf(low_out, "%s", label);
+	}
+
+	size_t i=0;
+	for (size_t subx=x*L; subx<(x+1)*L; subx++) {
+	  for (size_t suby=y*L; suby<(y+1)*L; suby++) {
+	    size_t offset = (subx*grids + suby)*grids + z*L;
+	    for (size_t subz=0; subz<L; subz++) {
+	      if (features_format == FEATURES_VARINT) {
+		norm_bits[i] = transmute(norms[offset+subz]);
+		his[i] = hi[offset+subz];
+		los[i] = lo[offset+subz];
+	      } else {
+		async_writer_printf(original_out, "%zu:%f ", i+1, norms[offset+subz]);
+		async_writer_printf(high_out, "%zu:%d ", i+1, hi[offset+subz]);
+		async_writer_printf(low_out, "%zu:%d ", i+1, lo[offset+subz]);
+	      }
+	      i++;
+	    }
+	  }
+	}
+
+	if (features_format == FEATURES_VARINT) {
+	  // delta chains restart at the first window of every z row
+	  print_varint_record(original_out, &original_state, example_type, z==0,
+			      norm_bits);
+	  print_varint_record(high_out, &high_state, example_type, z==0, his);
+	  print_varint_record(low_out, &low_state, example_type, z==0, los);
+	} else {
+	  async_writer_printf(original_out, "\n");
+	  async_writer_printf(high_out, "\n");
+	  async_writer_printf(low_out, "\n");
+	}
+      }
+    }
+  }
+}
+
+
+async_writer *
+open_feature_file(const char *filename, size_t H, size_t features,
+		  varint_kind kind, varint_state *state)
+{
+  async_writer *out = async_writer_open(filename, 1);
+  if (features_format == FEATURES_VARINT) {
+    varint_state_init(state, features);
+    if (out->offset == 0) {
+      varint_header header;
+      varint_make_header(&header, features, H, kind);
+      async_writer_write(out, &header, sizeof(header));
+    }
+  }
+  return out;
+}
+
+
+void
+open_feature_files(const char *original_file, const char *high_file,
+		   const char *low_file, size_t H, size_t features)
+{
+  original_out = open_feature_file(original_file, H, features,
+				   VARINT_KIND_FLOAT_BITS, &original_state);
+  high_out = open_feature_file(high_file, H, features, VARINT_KIND_INT32,
+			       &high_state);
+  low_out = open_feature_file(low_file, H, features, VARINT_KIND_INT32,
+			      &low_state);
+}
+
+
+void
+close_feature_files()
+{
+  const char *backend = async_writer_backend_name(original_out);
+  double stall = async_writer_close(original_out);
+  stall += async_writer_close(high_out);
+  stall += async_writer_close(low_out);
+  original_out = high_out = low_out = NULL;
+  fprintf(stderr, "output (%s): compute stalled %f s waiting on buffers\n",
+	  backend, stall);
+}
+
+
+typedef void (*varint_record_func)(void *arg, int label, const int32_t *values);
+
+/* Reads the header of a varint feature file into *header, then calls func
+ * on every record in order, decoding block by block
+ */
+void
+scan_feature_file(const char *in_file, varint_header *header,
+		  varint_record_func func, void *arg)
+{
+  assert(in_file != NULL);
+  assert(header != NULL);
+  assert(func != NULL);
+
+  FILE *in_fp = fopen(in_file, "rb");
+  assert(in_fp != NULL);
+
+  size_t got = fread(header, 1, sizeof(*header), in_fp);
+  assert(got == sizeof(*header));
+  assert(varint_check_header(header));
+
+  varint_state state;
+  varint_state_init(&state, header->features);
+
+  // a record is a flag byte and at least one byte per feature, so that is
+  // as many records as a block can ever hold
+  const size_t block_size = 1<<20;
+  const size_t max_records = block_size / (1 + header->features);
+  assert(VARINT_MAX_RECORD(header->features) <= block_size);
+  uint8_t *block = malloc(block_size);
+  int8_t *labels = malloc(max_records*sizeof(int8_t));
+  int32_t *values = malloc(max_records*header->features*sizeof(int32_t));
+  assert(block != NULL && labels != NULL && values != NULL);
+
+  size_t pending = 0;
+  while (1) {
+    size_t read = fread(block+pending, 1, block_size-pending, in_fp);
+    size_t len = pending + read;
+    if (len == 0) {
+      break;
+    }
+
+    size_t consumed;
+    size_t records = varint_decode_block(&state, block, len, max_records,
+					 labels, values, &consumed);
+    assert(records > 0 || read > 0);
+
+    for (size_t r=0; r<records; r++) {
+      func(arg, labels[r], values + r*header->features);
+    }
+
+    pending = len - consumed;
+    memmove(block, block+consumed, pending);
+    if (read == 0 && records == 0) {
+      break;
+    }
+  }
+  assert(pending == 0);
+
+  fclose(in_fp);
+  free(block);
+  free(labels);
+  free(values);
+}
+
+
+typedef struct _decode_job {
+  async_writer *out;
+  const varint_header *header;
+} decode_job;
+
+
+void
+decode_record(void *arg, int label, const int32_t *values)
+{
+  decode_job *job = arg;
+
+  async_writer_printf(job->out, "%s", (label==1) ? "+1 " : "-1 ");
+  for (size_t i=0; i<job->header->features; i++) {
+    if (job->header->kind == VARINT_KIND_FLOAT_BITS) {
+      async_writer_printf(job->out, "%zu:%f ", i+1, untransmute(values[i]));
+    } else {
+      async_writer_printf(job->out, "%zu:%d ", i+1, values[i]);
+    }
+  }
+  async_writer_printf(job->out, "\n");
+}
+
+
+/* Converts a varint feature file back into the text format, block by block */
+void
+decode_feature_file(const char *in_file, const char *out_file)
+{
+  assert(in_file != NULL);
+  assert(out_file != NULL);
+
+  varint_header header;
+  decode_job job = {async_writer_open(out_file, 0), &header};
+  scan_feature_file(in_file, &header, decode_record, &job);
+  async_writer_close(job.out);
+}
+
+
+/* Records of one label, re-encoded with the delta chains restarting where an
+ * unsharded run restarts them: at every tiles_per_row-th record of a label
+ */
+typedef struct _merge_job {
+  async_writer *out;
+  varint_state state;
+  int label;
+  uint32_t tiles_per_row;
+  size_t position;
+} merge_job;
+
+
+void
+merge_record(void *arg, int label, const int32_t *values)
+{
+  merge_job *job = arg;
+  if (label != job->label) {
+    return;
+  }
+
+  int reset = (job->position % job->tiles_per_row == 0);
+  print_varint_record(job->out, &(job->state), label, reset, values);
+  job->position++;
+}
+
+
+/**
+ * merge_feature_files: Joins the feature files written by the --shard k/N
+ *     runs of train, given in shard order, into the file the unsharded run
+ *     writes: every shard's clean records, then every shard's corrupted
+ *     records. Text and varint files are both accepted, varint records are
+ *     re-encoded so the delta chains match the unsharded file byte for byte.
+ *
+ * Requires: - each input holds the output of a single run
+ *
+ */
+void
+merge_feature_files(const char *out_file, char **in_files, const size_t count)
+{
+  assert(out_file != NULL);
+  assert(in_files != NULL);
+  assert(count > 0);
+
+  varint_header first;
+  memset(&first, 0, sizeof(first));
+  FILE *probe = fopen(in_files[0], "rb");
+  assert(probe != NULL);
+  size_t got = fread(&first, 1, sizeof(first), probe);
+  fclose(probe);
+  int varint = (got == sizeof(first) && varint_check_header(&first));
+
+  async_writer *out = async_writer_open(out_file, 0);
+  const int labels[2] = {1, -1};
+
+  if (!varint) {
+    char *line = NULL;
+    size_t capacity = 0;
+    for (size_t pass=0; pass<2; pass++) {
+      const char *label = (labels[pass]==1) ? "+1 " : "-1 ";
+      for (size_t f=0; f<count; f++) {
+	FILE *in_fp = fopen(in_files[f], "r");
+	assert(in_fp != NULL);
+	ssize_t len;
+	while ((len = getline(&line, &capacity, in_fp)) > 0) {
+	  if (strncmp(line, label, strlen(label)) == 0) {
+	    async_writer_write(out, line, len);
+	  }
+	}
+	fclose(in_fp);
+      }
+    }
+    free(line);
+    async_writer_close(out);
+    return;
+  }
+
+  async_writer_write(out, &first, sizeof(first));
+  merge_job job;
+  job.out = out;
+  job.tiles_per_row = first.tiles_per_row;
+  assert(job.tiles_per_row > 0);
+  varint_state_init(&(job.state), first.features);
+  for (size_t pass=0; pass<2; pass++) {
+    job.label = labels[pass];
+    job.position = 0;
+    for (size_t f=0; f<count; f++) {
+      varint_header header;
+      scan_feature_file(in_files[f], &header, merge_record, &job);
+      assert(header.features == first.features);
+      assert(header.tiles_per_row == first.tiles_per_row);
+      assert(header.kind == first.kind);
+    }
+  }
+  async_writer_close(out);
+}
+
+
+
+/********************************************************************************
+ * FEATURE SERVER: feature batches streamed to a consumer while they are made   *
+ *******************************************************************************/
+
+/* print_features for a feature_stream: one record per H-tile, holding the
+ * tile's L*L norms and their hi/lo
+ */
+void
+serve_features(feature_stream *stream, int example_type, size_t grids,
+	       const float **norms, size_t H, int32_t m)
+{
+  assert(stream != NULL);
+  assert(norms != NULL);
+  assert(H*L <= grids);
+  assert(stream->features == L*L);
+
+  float tile_norms[L*L];
+  int32_t his[L*L];
+  int32_t los[L*L];
+
+  for (size_t x=0; x<H; x++) {
+    for (size_t y=0; y<H; y++) {
+      size_t i=0;
+      for (size_t subx=x*L; subx<(x+1)*L; subx++) {
+	for (size_t suby=y*L; suby<(y+1)*L; suby++) {
+	  tile_norms[i] = norms[subx][suby];
+	  split_float(tile_norms[i], m, &(his[i]), &(los[i]));
+	  i++;
+	}
+      }
+      feature_stream_add(stream, example_type, tile_norms, his, los);
+    }
+  }
+}
+
+
+
+/********************************************************************************
+ * CLEAN FEATURE CACHE                                                          *
+ *******************************************************************************/
+
+/* The clean half of every dataset depends only on (func_choice, low, high, H,
+ * A, m), so its norms and hi/lo planes are stored on disk under a hash of
+ * those parameters and the cache format version. Bump CACHE_VERSION
+ * whenever the generation or the file layout changes.
+ */
+static const char CACHE_MAGIC[4] = {'H', 'L', 'C', 'C'};
+static const uint32_t CACHE_VERSION = 1;
+
+typedef struct _cache_key {
+  uint32_t version;
+  uint32_t func_choice;
+  int32_t low_bits;
+  int32_t high_bits;
+  uint64_t H;
+  uint64_t A;
+  int32_t m;
+  uint32_t L;
+} cache_key;
+
+typedef struct _cache_header {
+  char magic[4];
+  uint32_t grids;
+  cache_key key;
+} cache_header;
+
+
+void
+make_cache_key(cache_key *key, size_t func_choice, float low, float high,
+	       size_t H, size_t A, int32_t m)
+{
+  assert(key != NULL);
+
+  memset(key, 0, sizeof(*key));
+  key->version = CACHE_VERSION;
+  key->func_choice = func_choice;
+  key->low_bits = transmute(low);
+  key->high_bits = transmute(high);
+  key->H = H;
+  key->A = A;
+  key->m = m;
+  key->L = L;
+}
+
+
+// 64 bit FNV-1a
+uint64_t
+hash_bytes(const void *data, size_t size)
+{
+  const uint8_t *bytes = data;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i=0; i<size; i++) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+
+char *
+cache_path(const char *cache_dir, const cache_key *key)
+{
+  assert(cache_dir != NULL);
+  assert(key != NULL);
+
+  size_t size = strlen(cache_dir) + 64;
+  char *path = malloc(size);
+  assert(path != NULL);
+  snprintf(path, size, "%s/clean-%016lx.bin", cache_dir,
+	   (unsigned long) hash_bytes(key, sizeof(*key)));
+  return path;
+}
+
+
+/* Returns 1 and fills the three grids x grids tables on a hit, 0 on a miss
+ * or on a file written for different parameters
+ */
+int
+load_clean_cache(const char *cache_dir, const cache_key *key, size_t grids,
+		 float ***norms_out, int32_t ***hi_out, int32_t ***lo_out)
+{
+  assert(norms_out != NULL);
+  assert(hi_out != NULL);
+  assert(lo_out != NULL);
+
+  char *path = cache_path(cache_dir, key);
+  FILE *fp = fopen(path, "rb");
+  free(path);
+  if (fp == NULL) {
+    return 0;
+  }
+
+  cache_header header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+      memcmp(&(header.key), key, sizeof(*key)) != 0 ||
+      header.grids != grids) {
+    fclose(fp);
+    return 0;
+  }
+
+  float **norms = malloc(grids*sizeof(float*));
+  int32_t **hi = malloc(grids*sizeof(int32_t*));
+  int32_t **lo = malloc(grids*sizeof(int32_t*));
+  assert(norms != NULL && hi != NULL && lo != NULL);
+
+  int ok = 1;
+  for (size_t x=0; x<grids; x++) {
+    norms[x] = malloc(grids*sizeof(float));
+    assert(norms[x] != NULL);
+    ok = ok && fread(norms[x], sizeof(float), grids, fp) == grids;
+  }
+  for (size_t x=0; x<grids; x++) {
+    hi[x] = malloc(grids*sizeof(int32_t));
+    assert(hi[x] != NULL);
+    ok = ok && fread(hi[x], sizeof(int32_t), grids, fp) == grids;
+  }
+  for (size_t x=0; x<grids; x++) {
+    lo[x] = malloc(grids*sizeof(int32_t));
+    assert(lo[x] != NULL);
+    ok = ok && fread(lo[x], sizeof(int32_t), grids, fp) == grids;
+  }
+  fclose(fp);
+
+  if (!ok) {
+    for (size_t x=0; x<grids; x++) {
+      free(norms[x]);
+      free(hi[x]);
+      free(lo[x]);
+    }
+    free(norms);
+    free(hi);
+    free(lo);
+    return 0;
+  }
+
+  *norms_out = norms;
+  *hi_out = hi;
+  *lo_out = lo;
+  return 1;
+}
+
+
+/* Written to a temporary name and renamed, so concurrent runs never see a
+ * partial entry
+ */
+void
+store_clean_cache(const char *cache_dir, const cache_key *key, size_t grids,
+		  const float **norms, int32_t m)
+{
+  assert(norms != NULL);
+
+  char *path = cache_path(cache_dir, key);
+  size_t tmp_size = strlen(path) + 32;
+  char *tmp_path = malloc(tmp_size);
+  assert(tmp_path != NULL);
+  snprintf(tmp_path, tmp_size, "%s.tmp.%ld", path, (long) getpid());
+
+  FILE *fp = fopen(tmp_path, "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "cache: cannot write %s\n", tmp_path);
+    free(tmp_path);
+    free(path);
+    return;
+  }
+
+  cache_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+  header.grids = grids;
+  header.key = *key;
+
+  int32_t *plane_hi = malloc(grids*grids*sizeof(int32_t));
+  int32_t *plane_lo = malloc(grids*grids*sizeof(int32_t));
+  assert(plane_hi != NULL && plane_lo != NULL);
+  for (size_t x=0; x<grids; x++) {
+    int32_t *row_hi = plane_hi + x*grids;
+    int32_t *row_lo = plane_lo + x*grids;
+    split_array(grids, norms[x], m, &row_hi, &row_lo);
+  }
+
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+  for (size_t x=0; x<grids; x++) {
+    ok = ok && fwrite(norms[x], sizeof(float), grids, fp) == grids;
+  }
+  ok = ok && fwrite(plane_hi, sizeof(int32_t), grids*grids, fp) == grids*grids;
+  ok = ok && fwrite(plane_lo, sizeof(int32_t), grids*grids, fp) == grids*grids;
+  ok = (fclose(fp) == 0) && ok;
+
+  if (ok) {
+    ok = rename(tmp_path, path) == 0;
+  }
+  if (!ok) {
+    remove(tmp_path);
+    fprintf(stderr, "cache: cannot write %s\n", path);
+  }
+
+  free(plane_hi);
+  free(plane_lo);
+  free(tmp_path);
+  free(path);
+}
+
+
+
+/********************************************************************************
+ * FIELD SIMULATION: time stepping with periodic checksum verification          *
+ *******************************************************************************/
+
+/* Explicit heat equation step with periodic boundaries,
+ *   u' = u + SIM_ALPHA*(north + south + east + west - 4u)
+ * When 'norms' is not NULL the tile norms of u' are accumulated during the
+ * sweep. Each tile receives its values in the same row-major order as
+ * calc_norm, so the result is bit-identical to calc_2d_norm(u') without a
+ * second pass over the field.
+ */
+static const float SIM_ALPHA = 0.1f;
+
+void
+heat_step(const size_t A, const float **u, float **u_next,
+	  const size_t grids, float **norms)
+{
+  assert(u != NULL);
+  assert(u_next != NULL);
+
+  size_t grid_width = A/grids;
+  if (norms != NULL) {
+    for (size_t gx=0; gx<grids; gx++) {
+      memset(norms[gx], 0, grids*sizeof(float));
+    }
+  }
+
+  for (size_t i=0; i<A; i++) {
+    const float *north = u[(i+A-1)%A];
+    const float *row = u[i];
+    const float *south = u[(i+1)%A];
+    float *out = u_next[i];
+
+    out[0] = row[0] + SIM_ALPHA*(north[0] + south[0] + row[A-1] + row[1]
+				 - 4*row[0]);
+    for (size_t j=1; j<A-1; j++) {
+      out[j] = row[j] + SIM_ALPHA*(north[j] + south[j] + row[j-1] + row[j+1]
+				   - 4*row[j]);
+    }
+    out[A-1] = row[A-1] + SIM_ALPHA*(north[A-1] + south[A-1] + row[A-2]
+				     + row[0] - 4*row[A-1]);
+
+    if (norms != NULL) {
+      float *norm_row = norms[i/grid_width];
+      for (size_t gy=0; gy<grids; gy++) {
+	float sum = norm_row[gy];
+	for (size_t j=gy*grid_width; j<(gy+1)*grid_width; j++) {
+	  sum += out[j];
+	}
+	norm_row[gy] = sum;
+      }
+    }
+  }
+}
+
+
+float **
+alloc_2d_float(const size_t x, const size_t y)
+{
+  float **output = malloc(x*sizeof(float*));
+  assert(output != NULL);
+  for (size_t index=0; index<x; index++) {
+    output[index] = malloc(y*sizeof(float));
+    assert(output[index] != NULL);
+  }
+  return output;
+}
+
+
+int32_t **
+alloc_2d_int(const size_t x, const size_t y)
+{
+  int32_t **output = malloc(x*sizeof(int32_t*));
+  assert(output != NULL);
+  for (size_t index=0; index<x; index++) {
+    output[index] = malloc(y*sizeof(int32_t));
+    assert(output[index] != NULL);
+  }
+  return output;
+}
+
+
+double
+now_seconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+
+typedef struct _sim_event {
+  size_t step;
+  size_t tile_x;
+  size_t tile_y;
+  long detected_at;   /* step of the detecting checkpoint, -1 if never */
+} sim_event;
+
+
+int
+compare_size(const void *a, const void *b)
+{
+  size_t x = ((const sim_event *) a)->step;
+  size_t y = ((const sim_event *) b)->step;
+  return (x > y) - (x < y);
+}
+
+
+/* Advances a field for T steps, injecting 'event_count' single bit faults
+ * at random steps with insert_2d_faults, and checks the norm hi/lo split
+ * every 'interval' steps. The expected checksums come from a fault free
+ * reference trajectory advanced in lockstep, standing in for a stored or
+ * replicated checksum; its cost is not counted as overhead. On detection
+ * the field is rolled back to the reference, so events are independent.
+ *
+ * Each event is judged once, at the first checkpoint after its step, and
+ * counts as detected only if the checksum of its own H-tile mismatches
+ * there. An event missed at that checkpoint has escaped: a later
+ * detection, even on the same tile, is never credited to it.
+ */
+void
+simulate(const size_t func_choice, const float low, const float high,
+	 const size_t H, const size_t A, const size_t fault_low_bit,
+	 const size_t fault_high_bit, const size_t event_count,
+	 const int32_t m, const size_t T, const size_t interval)
+{
+  assert(interval > 0);
+  assert(event_count <= T);
+  assert(A > 2);
+
+  size_t grids = H*L;
+  const float **input = (const float**) gen_2d_input(low, high, A, A);
+  float **u = map_2d_func(func_choice, A, A, input);
+  float **r = map_2d_func(func_choice, A, A, input);
+  float **u_next = alloc_2d_float(A, A);
+  float **r_next = alloc_2d_float(A, A);
+
+  float **norms = alloc_2d_float(grids, grids);
+  float **ref_norms = alloc_2d_float(grids, grids);
+  int32_t **ref_hi = alloc_2d_int(grids, grids);
+  int32_t **ref_lo = alloc_2d_int(grids, grids);
+
+  // distinct random steps, in order
+  sim_event *events = calloc(event_count > 0 ? event_count : 1, sizeof(sim_event));
+  char *taken = calloc(T, sizeof(char));
+  assert(events != NULL && taken != NULL);
+  for (size_t e=0; e<event_count; e++) {
+    size_t step;
+    do {
+      step = rand_size(0, T-1);
+    } while (taken[step]);
+    taken[step] = 1;
+    events[e].step = step;
+    events[e].tile_x = rand_size(0, H-1);
+    events[e].tile_y = rand_size(0, H-1);
+    events[e].detected_at = -1;
+  }
+  free(taken);
+  qsort(events, event_count, sizeof(sim_event), compare_size);
+
+  double plain_time = 0, checked_time = 0, split_time = 0;
+  size_t plain_steps = 0, checkpoints = 0;
+  size_t next_event = 0, first_pending = 0;
+
+  for (size_t step=0; step<T; step++) {
+    while (next_event < event_count && events[next_event].step == step) {
+      insert_2d_faults(A, u, H, fault_low_bit, fault_high_bit, 1,
+		       events[next_event].tile_x, events[next_event].tile_y);
+      next_event++;
+    }
+
+    int checkpoint = ((step+1) % interval == 0);
+    double start = now_seconds();
+    heat_step(A, (const float**) u, u_next, grids, checkpoint ? norms : NULL);
+    double stepped = now_seconds();
+    heat_step(A, (const float**) r, r_next, grids, checkpoint ? ref_norms : NULL);
+
+    float **swap = u; u = u_next; u_next = swap;
+    swap = r; r = r_next; r_next = swap;
+
+    if (!checkpoint) {
+      plain_time += stepped - start;
+      plain_steps++;
+      continue;
+    }
+
+    checked_time += stepped - start;
+    checkpoints++;
+
+    // expected checksum, not charged to the checked field
+    split_2d_array(grids, grids, (const float**) ref_norms, m, &ref_hi, &ref_lo);
+
+    start = now_seconds();
+    int mismatch = verify_split_2d(grids, grids, (const float**) norms, m,
+				   0, grids, 0, grids, (const int32_t**) ref_hi,
+				   (const int32_t**) ref_lo, NULL, 0) != 0;
+    split_time += now_seconds() - start;
+
+    // only events injected since the previous checkpoint are judged here
+    for (size_t e=first_pending; mismatch && e<next_event; e++) {
+      size_t tx = events[e].tile_x*L;
+      size_t ty = events[e].tile_y*L;
+      if (verify_split_2d(grids, grids, (const float**) norms, m,
+			  tx, tx+L, ty, ty+L, (const int32_t**) ref_hi,
+			  (const int32_t**) ref_lo, NULL, 0) != 0) {
+	events[e].detected_at = step;
+      }
+    }
+    first_pending = next_event;
+
+    if (mismatch) {
+      for (size_t index=0; index<A; index++) {
+	memcpy(u[index], r[index], A*sizeof(float));
+      }
+    }
+  }
+
+  size_t detected = 0;
+  size_t total_latency = 0, max_latency = 0;
+  // detected_step -1: missed at the first checkpoint after the event
+  printf("event, injected_step, tile_x, tile_y, detected_step, latency\n");
+  for (size_t e=0; e<event_count; e++) {
+    if (events[e].detected_at < 0) {
+      printf("%zu, %zu, %zu, %zu, -1, -1\n", e, events[e].step,
+	     events[e].tile_x, events[e].tile_y);
+      continue;
+    }
+    size_t latency = events[e].detected_at - events[e].step;
+    detected++;
+    total_latency += latency;
+    max_latency = (latency > max_latency) ? latency : max_latency;
+    printf("%zu, %zu, %zu, %zu, %ld, %zu\n", e, events[e].step,
+	   events[e].tile_x, events[e].tile_y, events[e].detected_at, latency);
+  }
+
+  double step_mean = (plain_steps > 0) ? plain_time/plain_steps :
+    checked_time/checkpoints;
+  double checksum_time = (checked_time - step_mean*checkpoints) + split_time;
+  printf("\nsteps, interval, events, detected, undetected, "
+	 "mean_latency, max_latency, step_seconds, checksum_seconds, "
+	 "overhead_percent\n");
+  printf("%zu, %zu, %zu, %zu, %zu, %f, %zu, %f, %f, %f\n",
+	 T, interval, event_count, detected, event_count-detected,
+	 (detected > 0) ? (double) total_latency/detected : 0.0, max_latency,
+	 step_mean*T, checksum_time, 100.0*checksum_time/(step_mean*T));
+
+  free(events);
+}
+
+
+
+/********************************************************************************
+ * BATCHED SMALL FIELDS: norms and hi/lo of many same-shaped fields at once     *
+ *******************************************************************************/
+
+/* A batch is 'count' A x A fields packed back to back, entry (x, y) of field
+ * f at fields[(f*A + x)*A + y]. Its tile norms are packed the same way,
+ * norm (tx, ty) of field f at norms[(f*grids + tx)*grids + ty].
+ *
+ * Summing a tile is a serial chain of float adds, which the compiler may
+ * not reorder, so for a single small field there is nothing to vectorise.
+ * Fields of up to BATCH_LANES_MAX_A on a side are instead copied
+ * BATCH_LANES at a time into a lane-interleaved buffer, entry e of lane l at
+ * e*BATCH_LANES + l, and every tile is summed for all lanes at once with
+ * one vector add per entry. Each field still sums its entries in
+ * calc_norm's order, so the norms are bit identical to calc_2d_norm.
+ */
+#define BATCH_LANES 16
+#define BATCH_LANES_MAX_A 64
+
+
+/* Tile norms of the fields [first, first+lanes) of a batch of small fields */
+void
+batch_norms_interleaved(const size_t A, const size_t grids, const float *fields,
+			const size_t first, const size_t lanes, float *buffer,
+			float *norms)
+{
+  assert(lanes <= BATCH_LANES);
+
+  size_t field_size = A*A;
+  size_t grid_width = A/grids;
+
+  // lane loops run to 'lanes', not the constant BATCH_LANES, so that they
+  // are vectorised rather than fully unrolled
+  for (size_t e=0; e<field_size; e++) {
+    float *entry = &(buffer[e*BATCH_LANES]);
+    for (size_t l=0; l<lanes; l++) {
+      entry[l] = fields[(first+l)*field_size + e];
+    }
+  }
+
+  for (size_t tx=0; tx<grids; tx++) {
+    for (size_t ty=0; ty<grids; ty++) {
+      float sums[BATCH_LANES] = {0};
+      for (size_t x=tx*grid_width; x<(tx+1)*grid_width; x++) {
+	for (size_t y=ty*grid_width; y<(ty+1)*grid_width; y++) {
+	  const float *entry = &(buffer[(x*A + y)*BATCH_LANES]);
+	  for (size_t l=0; l<lanes; l++) {
+	    sums[l] += entry[l];
+	  }
+	}
+      }
+      for (size_t l=0; l<lanes; l++) {
+	norms[((first+l)*grids + tx)*grids + ty] = sums[l];
+      }
+    }
+  }
+}
+
+
+/**
+ * batch_norms_split: Computes the tile norms of every field of a packed
+ *     batch and splits them, hi/lo of norm i at hi[i] and lo[i]
+ *
+ * Requires: - fields holds count*A*A floats, A%grids == 0
+ *           - norms, hi and lo have room for count*grids*grids entries
+ *
+ * Ensures: - norms are bit identical to calc_2d_norm of each field
+ *
+ */
+void
+batch_norms_split(const size_t count, const size_t A, const size_t grids,
+		  const float *fields, const int32_t m,
+		  float *norms, int32_t *hi, int32_t *lo)
+{
+  assert(fields != NULL);
+  assert(norms != NULL && hi != NULL && lo != NULL);
+  assert(A%grids == 0);
+
+  size_t grid_width = A/grids;
+
+  if (A <= BATCH_LANES_MAX_A) {
+    float *buffer = malloc(BATCH_LANES*A*A*sizeof(float));
+    assert(buffer != NULL);
+    for (size_t first=0; first<count; first+=BATCH_LANES) {
+      size_t lanes = (count - first < BATCH_LANES) ? count - first : BATCH_LANES;
+      batch_norms_interleaved(A, grids, fields, first, lanes, buffer, norms);
+    }
+    free(buffer);
+  } else {
+    // wide fields: rows are streamed once into the running tile sums
+    memset(norms, 0, count*grids*grids*sizeof(float));
+    for (size_t f=0; f<count; f++) {
+      for (size_t x=0; x<A; x++) {
+	const float *row = fields + (f*A + x)*A;
+	float *sums = norms + (f*grids + x/grid_width)*grids;
+	for (size_t ty=0; ty<grids; ty++) {
+	  float sum = sums[ty];
+	  for (size_t y=ty*grid_width; y<(ty+1)*grid_width; y++) {
+	    sum += row[y];
+	  }
+	  sums[ty] = sum;
+	}
+      }
+    }
+  }
+
+  // the norms of the whole batch are one contiguous array
+  split_array(count*grids*grids, norms, m, &hi, &lo);
+}
+
+
+/* Times batch_norms_split against calc_2d_norm's per tile loop and
+ * split_2d_array run once per field, and checks that both agree bit for
+ * bit. All buffers are allocated before either timed loop. Returns the
+ * number of mismatching tiles.
+ */
+size_t
+benchmark_batch(const size_t func_choice, const float low, const float high,
+		const size_t A, const size_t grids, const size_t count,
+		const int32_t m, const size_t reps)
+{
+  assert(A%grids == 0);
+  assert(reps > 0);
+
+  size_t tiles = grids*grids;
+  float *fields = malloc(count*A*A*sizeof(float));
+  float *norms = malloc(count*tiles*sizeof(float));
+  int32_t *hi = malloc(count*tiles*sizeof(int32_t));
+  int32_t *lo = malloc(count*tiles*sizeof(int32_t));
+  const float ***rows = malloc(count*sizeof(float**));
+  float ***field_norms = malloc(count*sizeof(float**));
+  int32_t ***field_hi = malloc(count*sizeof(int32_t**));
+  int32_t ***field_lo = malloc(count*sizeof(int32_t**));
+  assert(fields != NULL && norms != NULL && hi != NULL && lo != NULL);
+  assert(rows != NULL && field_norms != NULL);
+  assert(field_hi != NULL && field_lo != NULL);
+
+  // every field gets its own slice of [low, high)
+  float width = (high-low)/count;
+  for (size_t f=0; f<count; f++) {
+    float **input = gen_2d_input(low + f*width, low + (f+1)*width, A, A);
+    for (size_t x=0; x<A; x++) {
+      map_func_into(func_choice, A, input[x], fields + (f*A + x)*A);
+      free(input[x]);
+    }
+    free(input);
+  }
+
+  // per field, with the row tables and result planes that path needs
+  for (size_t f=0; f<count; f++) {
+    rows[f] = malloc(A*sizeof(float*));
+    assert(rows[f] != NULL);
+    for (size_t x=0; x<A; x++) {
+      rows[f][x] = fields + (f*A + x)*A;
+    }
+    field_norms[f] = alloc_2d_float(grids, grids);
+    field_hi[f] = alloc_2d_int(grids, grids);
+    field_lo[f] = alloc_2d_int(grids, grids);
+  }
+
+  double start = now_seconds();
+  for (size_t rep=0; rep<reps; rep++) {
+    for (size_t f=0; f<count; f++) {
+      for (size_t tx=0; tx<grids; tx++) {
+	for (size_t ty=0; ty<grids; ty++) {
+	  field_norms[f][tx][ty] = calc_norm(A, rows[f], grids, tx, ty);
+	}
+      }
+      split_2d_array(grids, grids, (const float**) field_norms[f], m,
+		     &(field_hi[f]), &(field_lo[f]));
+    }
+  }
+  double per_field_time = (now_seconds() - start)/reps;
+
+  start = now_seconds();
+  for (size_t rep=0; rep<reps; rep++) {
+    batch_norms_split(count, A, grids, fields, m, norms, hi, lo);
+  }
+  double batch_time = (now_seconds() - start)/reps;
+
+  size_t mismatches = 0;
+  for (size_t f=0; f<count; f++) {
+    for (size_t tx=0; tx<grids; tx++) {
+      for (size_t ty=0; ty<grids; ty++) {
+	size_t index = (f*grids + tx)*grids + ty;
+	mismatches += (transmute(field_norms[f][tx][ty]) != transmute(norms[index]) ||
+		       field_hi[f][tx][ty] != hi[index] ||
+		       field_lo[f][tx][ty] != lo[index]);
+      }
+    }
+  }
+
+  printf("fields, A, grids, mismatches, per_field_seconds, batch_seconds, speedup\n");
+  printf("%zu, %zu, %zu, %zu, %f, %f, %f\n", count, A, grids, mismatches,
+	 per_field_time, batch_time, per_field_time/batch_time);
+
+  for (size_t f=0; f<count; f++) {
+    for (size_t tx=0; tx<grids; tx++) {
+      free(field_norms[f][tx]);
+      free(field_hi[f][tx]);
+      free(field_lo[f][tx]);
+    }
+    free(field_norms[f]);
+    free(field_hi[f]);
+    free(field_lo[f]);
+    free(rows[f]);
+  }
+  free(rows);
+  free(field_norms);
+  free(field_hi);
+  free(field_lo);
+  free(fields);
+  free(norms);
+  free(hi);
+  free(lo);
+
+  return mismatches;
+}
+
+
+
+/********************************************************************************
+ * EXHAUSTIVE FAULT ENUMERATION                                                 *
+ *******************************************************************************/
+
+/* Enumerates every (norm, bit) pair with bit in [fault_low_bit,
+ * fault_high_bit], deriving the faulty hi/lo from the clean product with
+ * split_float_flip. A per bit coverage summary always goes to summary_file,
+ * the full delta table to table_file when it is not NULL.
+ */
+void
+exhaustive_norm_faults(size_t grids, const float **norms, int32_t m,
+		       const size_t fault_low_bit, const size_t fault_high_bit,
+		       const char *summary_file, const char *table_file)
+{
+  assert(norms != NULL);
+  assert(summary_file != NULL);
+  assert(fault_low_bit <= fault_high_bit);
+  assert(fault_high_bit < BITS_IN_FLOAT);
+
+  uint64_t detected[BITS_IN_FLOAT];
+  uint64_t hi_changed[BITS_IN_FLOAT];
+  uint64_t lo_changed[BITS_IN_FLOAT];
+  memset(detected, 0, sizeof(detected));
+  memset(hi_changed, 0, sizeof(hi_changed));
+  memset(lo_changed, 0, sizeof(lo_changed));
+
+  FILE *table_fp = NULL;
+  if (table_file != NULL) {
+    table_fp = fopen(table_file, "w");
+    assert(table_fp != NULL);
+    fprintf(table_fp, "x, y, bit, y_hi, y'_hi, y_lo, y'_lo\n");
+  }
+
+  for (size_t x=0; x<grids; x++) {
+    for (size_t y=0; y<grids; y++) {
+      int32_t x_int = transmute(norms[x][y]);
+      int64_t product = (int64_t) x_int * m;
+      int32_t y_hi, y_lo;
+      split_float(norms[x][y], m, &y_hi, &y_lo);
+
+      for (size_t bit=fault_low_bit; bit<=fault_high_bit; bit++) {
+	int32_t yp_hi, yp_lo;
+	split_float_flip(x_int, product, m, bit, &yp_hi, &yp_lo);
+
+	hi_changed[bit] += (y_hi != yp_hi);
+	lo_changed[bit] += (y_lo != yp_lo);
+	detected[bit] += (y_hi != yp_hi) || (y_lo != yp_lo);
+
+	if (table_fp != NULL) {
+	  fprintf(table_fp, "%zu, %zu, %zu, %d, %d, %d, %d\n",
+		  x, y, bit, y_hi, yp_hi, y_lo, yp_lo);
+	}
+      }
+    }
+  }
+
+  if (table_fp != NULL) {
+    fclose(table_fp);
+  }
+
+  FILE *summary_fp = fopen(summary_file, "w");
+  assert(summary_fp != NULL);
+  fprintf(summary_fp, "bit, norms, detected, coverage, hi_changed, lo_changed\n");
+  for (size_t bit=fault_low_bit; bit<=fault_high_bit; bit++) {
+    fprintf(summary_fp, "%zu, %zu, %lu, %f, %lu, %lu\n",
+	    bit, grids*grids, (unsigned long) detected[bit],
+	    (double) detected[bit] / (grids*grids),
+	    (unsigned long) hi_changed[bit], (unsigned long) lo_changed[bit]);
+  }
+  fclose(summary_fp);
+}
+
+
+
+/********************************************************************************
+ * ARGUMENT PARSING                                                             *
+ *******************************************************************************/
+
+
+unsigned long long
+get_unsigned_long_long(const char *in)
+{
+  char * pt;
+  unsigned long long out = strtoull(in, &pt, 0);
+  if (errno == ERANGE ||
+      errno == EINVAL ||
+      in+strlen(in) != pt) {
+    assert(0);
+  }
+  return out;
+}
+
+
+float
+get_float(const char *in)
+{
+  char * pt;
+  float out = (float) strtod(in, &pt);
+  if (errno == ERANGE ||
+      errno == EINVAL ||
+      in+strlen(in) != pt) {
+    assert(0);
+  }
+  return out; 
+}
+
+
+double
+write_2d_int_array(const char *filename, const size_t x, const size_t y, 
+		   const int32_t **input)
+{
+  assert(filename != NULL);
+  assert(input != NULL);
+
+  async_writer *out = async_writer_open(filename, 0);
+
+  for (size_t x_index=0; x_index < x; x_index++) {
+    for (size_t y_index=0; y_index < y; y_index++) {
+      async_writer_printf(out, "%d, ", input[x_index][y_index]);
+    }
+    async_writer_printf(out, "\n");
+  }
+
+  return async_writer_close(out);
+}
+
+
+double
+write_2d_float_array(const char *filename, const size_t x, const size_t y, 
+		     const float **input)
+{
+  assert(filename != NULL);
+  assert(input != NULL);
+
+  async_writer *out = async_writer_open(filename, 0);
+
+  for (size_t x_index=0; x_index < x; x_index++) {
+    for (size_t y_index=0; y_index < y; y_index++) {
+      async_writer_printf(out, "%f, ", input[x_index][y_index]);
+    }
+    async_writer_printf(out, "\n");
+  }
+
+  return async_writer_close(out);
+}
+
+
+
+/* Optional flags, given between the mode and its positional arguments */
+typedef struct _run_options {
+  feature_format format;
+  const char *cache_dir;
+  int threads;
+  int column_major;
+  size_t halo;
+  int toeplitz;
+  const char *socket_path;
+  size_t batch_size;
+  size_t shard_index;
+  size_t shard_count;
+  int seeded;
+  uint64_t seed;
+  unsigned given;        /* RUN_OPTION_* bits of the flags on the command line */
+} run_options;
+
+enum {
+  RUN_OPTION_FORMAT = 1<<0,
+  RUN_OPTION_CACHE_DIR = 1<<1,
+  RUN_OPTION_THREADS = 1<<2,
+  RUN_OPTION_LAYOUT = 1<<3,
+  RUN_OPTION_HALO = 1<<4,
+  RUN_OPTION_TOEPLITZ = 1<<5,
+  RUN_OPTION_SOCKET = 1<<6,
+  RUN_OPTION_BATCH_SIZE = 1<<7,
+  RUN_OPTION_SHARD = 1<<8,
+  RUN_OPTION_SEED = 1<<9
+};
+
+/* Long option names, in RUN_OPTION_* bit order */
+static const char *RUN_OPTION_NAMES[] =
+  {"feature-format", "cache-dir", "threads", "layout", "halo", "toeplitz",
+   "socket", "batch-size", "shard", "seed"};
+
+
+int
+parse_run_options(int argc, char **argv, run_options *options)
+{
+  assert(options != NULL);
+
+  options->format = FEATURES_TEXT;
+  options->cache_dir = NULL;
+  options->threads = 0;
+  options->column_major = 0;
+  options->halo = 0;
+  options->toeplitz = 0;
+  options->socket_path = NULL;
+  options->batch_size = 256;
+  options->shard_index = 0;
+  options->shard_count = 1;
+  options->seeded = 0;
+  options->seed = 0;
+  options->given = 0;
+
+  static struct option long_options[] =
+    {
+      {"feature-format", required_argument, NULL, 'F'},
+      {"cache-dir", required_argument, NULL, 'C'},
+      {"threads", required_argument, NULL, 'T'},
+      {"layout", required_argument, NULL, 'L'},
+      {"halo", required_argument, NULL, 'H'},
+      {"toeplitz", no_argument, NULL, 'P'},
+      {"socket", required_argument, NULL, 'S'},
+      {"batch-size", required_argument, NULL, 'B'},
+      {"shard", required_argument, NULL, 'K'},
+      {"seed", required_argument, NULL, 'D'},
+      {0, 0, 0, 0}
+    };
+
+  // '+' stops at the first positional, which may be a negative number
+  optind = 2;
+  int c;
+  while ((c = getopt_long(argc, argv, "+", long_options, NULL)) != -1) {
+    switch (c)
+      {
+      case 'F':
+	options->given |= RUN_OPTION_FORMAT;
+	if (strcmp(optarg, "text") == 0) {
+	  options->format = FEATURES_TEXT;
+	} else if (strcmp(optarg, "varint") == 0) {
+	  options->format = FEATURES_VARINT;
+	} else {
+	  assert(0);
+	}
+	break;
+
+      case 'C':
+	options->given |= RUN_OPTION_CACHE_DIR;
+	options->cache_dir = optarg;
+	break;
+
+      case 'T':
+	options->given |= RUN_OPTION_THREADS;
+	options->threads = get_unsigned_long_long(optarg);
+	assert(options->threads > 0);
+	break;
+
+      case 'L':
+	options->given |= RUN_OPTION_LAYOUT;
+	if (strcmp(optarg, "row") == 0) {
+	  options->column_major = 0;
+	} else if (strcmp(optarg, "column") == 0) {
+	  options->column_major = 1;
+	} else {
+	  assert(0);
+	}
+	break;
+
+      case 'H':
+	options->given |= RUN_OPTION_HALO;
+	options->halo = get_unsigned_long_long(optarg);
+	break;
+
+      case 'P':
+	options->given |= RUN_OPTION_TOEPLITZ;
+	options->toeplitz = 1;
+	break;
+
+      case 'S':
+	options->given |= RUN_OPTION_SOCKET;
+	options->socket_path = optarg;
+	break;
+
+      case 'B':
+	options->given |= RUN_OPTION_BATCH_SIZE;
+	// checked against the record width by the mode, see serve
+	options->batch_size = get_unsigned_long_long(optarg);
+	break;
+
+      case 'K': {
+	options->given |= RUN_OPTION_SHARD;
+	int parsed = sscanf(optarg, "%zu/%zu", &(options->shard_index),
+			    &(options->shard_count));
+	assert(parsed == 2);
+	assert(options->shard_index < options->shard_count);
+	break;
+      }
+
+      case 'D':
+	options->given |= RUN_OPTION_SEED;
+	options->seeded = 1;
+	options->seed = get_unsigned_long_long(optarg);
+	break;
+
+      default:
+	assert(0);
+      }
+  }
+
+  return optind;
+}
+
+
+/**
+ * check_run_options: Halts if a flag outside 'allowed' was given, so that
+ *     a mode never silently ignores an option it does not support
+ *
+ * Requires: - options was filled in by parse_run_options
+ *
+ */
+void
+check_run_options(const char *mode, const run_options *options,
+		  const unsigned allowed)
+{
+  assert(mode != NULL);
+  assert(options != NULL);
+
+  unsigned unsupported = options->given & ~allowed;
+  size_t names = sizeof(RUN_OPTION_NAMES)/sizeof(RUN_OPTION_NAMES[0]);
+  for (size_t b=0; b<names; b++) {
+    if (unsupported & (1u<<b)) {
+      fprintf(stderr, "%s: --%s is not supported\n", mode, RUN_OPTION_NAMES[b]);
+    }
+  }
+  assert(unsupported == 0);
+}
+
+
+int
+main(int argc, char **argv) 
+{
+  srand(time(NULL));
+  assert(argc > 2);
+  char *mode = argv[1];
+
+  if (strcmp(mode, "train") == 0) {
+    run_options options;
+    int i = parse_run_options(argc, argv, &options);
+    assert(argc - i == 12);
+    // --socket and --batch-size belong to serve
+    check_run_options(mode, &options,
+		      ~(unsigned) (RUN_OPTION_SOCKET | RUN_OPTION_BATCH_SIZE));
+    features_format = options.format;
+    size_t func_choice = get_unsigned_long_long(argv[i++]);
+    assert(func_choice < NUM_FUNCTIONS);
+
+    float low = get_float(argv[i++]);
+    float high = get_float(argv[i++]);
+    assert(low < high);
+
+    size_t H = get_unsigned_long_long(argv[i++]);
+    size_t grids = H*L;
+    assert(H%L == 0);
+
+    size_t A = get_unsigned_long_long(argv[i++]);
+    assert(A%grids == 0);
+
+    size_t fault_low_bit = get_unsigned_long_long(argv[i++]);
+    size_t fault_high_bit = get_unsigned_long_long(argv[i++]);
+    assert(fault_low_bit <= fault_high_bit);
+
+    size_t fault_count = get_unsigned_long_long(argv[i++]);
+
+    int32_t m = get_unsigned_long_long(argv[i++]);
+
+    char *original_file = argv[i++];
+    char *low_file = argv[i++];
+    char *high_file = argv[i++];
+    open_feature_files(original_file, high_file, low_file, H, L*L);
+
+    placement pl_storage;
+    placement *pl = NULL;
+    if (options.threads > 0) {
+      pl = &pl_storage;
+      placement_init(pl, options.threads);
+      placement_report_thp(stderr);
+    }
+
+    // the memoized map regenerates its inputs itself, serially
+    assert(!options.toeplitz || pl == NULL);
+    const float **input = NULL;
+    if (!options.toeplitz) {
+      input = (const float**) stage_gen_2d_input(pl, low, high, A, grids);
+    }
+    size_t evaluations;
+
+    // norms and faults work in place on the solver's layout, when one is given
+    int use_view = options.column_major || options.halo > 0;
+
+    // a shard owns a contiguous range of tiles x*H + y and only maps and sums
+    // the rows of tiles under it; shards must agree on the faults, so a seed
+    // is required
+    size_t first_tile = (H*H*options.shard_index) / options.shard_count;
+    size_t end_tile = (H*H*(options.shard_index+1)) / options.shard_count;
+    int sharded = (options.shard_count > 1);
+    size_t grid_start = (first_tile/H)*L;
+    size_t grid_end = (end_tile > first_tile) ? ((end_tile-1)/H + 1)*L : grid_start;
+    size_t row_start = grid_start*(A/grids);
+    size_t row_end = grid_end*(A/grids);
+    if (sharded) {
+      assert(options.seeded);
+      assert(pl == NULL && !options.toeplitz && !use_view);
+      assert(options.cache_dir == NULL);
+    }
+
+
+    // Clean data
+    cache_key key;
+    make_cache_key(&key, func_choice, low, high, H, A, m);
+    float **cached_norms;
+    int32_t **cached_hi, **cached_lo;
+    if (options.cache_dir != NULL &&
+	load_clean_cache(options.cache_dir, &key, grids,
+			 &cached_norms, &cached_hi, &cached_lo)) {
+      print_features(1, grids, (const float**) cached_norms, H, m,
+		     (const int32_t**) cached_hi, (const int32_t**) cached_lo,
+		     first_tile, end_tile);
+    } else {
+      const float **x;
+      if (sharded) {
+	x = (const float**) map_2d_func_rows(func_choice, A, A, input,
+					     row_start, row_end);
+      } else if (options.toeplitz) {
+	x = (const float**) map_2d_func_toeplitz(func_choice, low, high, A,
+						 &evaluations);
+      } else {
+	x = (const float**) stage_map_2d_func(pl, func_choice, A, grids, input);
+      }
+
+      const float **norms;
+      if (sharded) {
+	norms = (const float**) calc_2d_norm_rows(A, x, grids, grid_start,
+						  grid_end);
+      } else if (use_view) {
+	field_view view = layout_field(x, A, options.column_major, options.halo);
+	norms = (const float**) calc_2d_norm_view(&view, grids);
+      } else {
+	norms = (const float**) stage_calc_2d_norm(pl, A, x, grids);
+      }
+
+      print_features(1, grids, norms, H, m, NULL, NULL, first_tile, end_tile);
+      if (options.cache_dir != NULL) {
+	store_clean_cache(options.cache_dir, &key, grids, norms, m);
+      }
+    }
+
+    //Corrupted
+    float **corrupt_x;
+    if (sharded) {
+      corrupt_x = map_2d_func_rows(func_choice, A, A, input, row_start, row_end);
+    } else if (options.toeplitz) {
+      corrupt_x = map_2d_func_toeplitz(func_choice, low, high, A, &evaluations);
+      // the same count as the toeplitz mode reports, per mapped field
+      fprintf(stderr, "train: toeplitz %zu entries, %zu evaluations\n",
+	      A*A, evaluations);
+    } else {
+      corrupt_x = stage_map_2d_func(pl, func_choice, A, grids, input);
+    }
+    const float **corrupt_norms;
+    if (use_view) {
+      field_view view = layout_field((const float**) corrupt_x, A,
+				     options.column_major, options.halo);
+      if (options.seeded) {
+	insert_tile_faults(A, NULL, &view, H, fault_low_bit, fault_high_bit,
+			   fault_count, options.seed, 0, H*H);
+      } else {
+	insert_full_faults_view(&view, H, fault_low_bit, fault_high_bit,
+				fault_count);
+      }
+      corrupt_norms = (const float**) calc_2d_norm_view(&view, grids);
+    } else {
+      if (options.seeded) {
+	insert_tile_faults(A, corrupt_x, NULL, H, fault_low_bit, fault_high_bit,
+			   fault_count, options.seed, first_tile, end_tile);
+      } else {
+	insert_full_faults(A, corrupt_x, H, fault_low_bit, fault_high_bit, 
+			   fault_count);
+      }
+      if (sharded) {
+	corrupt_norms = (const float**) calc_2d_norm_rows(A, (const float**) corrupt_x,
+							  grids, grid_start, grid_end);
+      } else {
+	corrupt_norms = (const float**) stage_calc_2d_norm(pl, A, (const float**)corrupt_x, grids);
+      }
+    }
+    print_features(-1, grids, corrupt_norms, H, m, NULL, NULL, first_tile,
+		   end_tile);
+
+    close_feature_files();
+    if (pl != NULL) {
+      placement_free(pl);
+    }
+    return 0;
+    
+
+  } else if (strcmp(mode, "serve") == 0) {
+    // train's data set, streamed as feature_stream frames instead of files
+    run_options options;
+    int i = parse_run_options(argc, argv, &options);
+    assert(argc - i == 9);
+    check_run_options(mode, &options, RUN_OPTION_SOCKET | RUN_OPTION_BATCH_SIZE);
+    size_t func_choice = get_unsigned_long_long(argv[i++]);
+    assert(func_choice < NUM_FUNCTIONS);
+
+    float low = get_float(argv[i++]);
+    float high = get_float(argv[i++]);
+    assert(low < high);
+
+    size_t H = get_unsigned_long_long(argv[i++]);
+    size_t grids = H*L;
+    assert(H%L == 0);
+
+    size_t A = get_unsigned_long_long(argv[i++]);
+    assert(A%grids == 0);
+
+    size_t fault_low_bit = get_unsigned_long_long(argv[i++]);
+    size_t fault_high_bit = get_unsigned_long_long(argv[i++]);
+    assert(fault_low_bit <= fault_high_bit);
+
+    size_t fault_count = get_unsigned_long_long(argv[i++]);
+
+    int32_t m = get_unsigned_long_long(argv[i++]);
+
+    // a frame's length is a uint32_t, so the batch must fit in it
+    if (!feature_stream_fits(L*L, options.batch_size)) {
+      fprintf(stderr, "serve: --batch-size %zu does not fit in one frame of"
+	      " %u features\n", options.batch_size, L*L);
+      return 1;
+    }
+
+    int fd = STDOUT_FILENO;
+    if (options.socket_path != NULL) {
+      fprintf(stderr, "serve: waiting for a consumer on %s\n",
+	      options.socket_path);
+      fd = feature_stream_listen(options.socket_path);
+    }
+    feature_stream stream;
+    feature_stream_open(&stream, fd, options.socket_path != NULL, L*L,
+			options.batch_size);
+
+    const float **input = (const float**) gen_2d_input(low, high, A, A);
+
+    // clean batches go out before the corrupted field is even made
+    const float **x = (const float**) map_2d_func(func_choice, A, A, input);
+    const float **norms = (const float**) calc_2d_norm(A, x, grids);
+    serve_features(&stream, 1, grids, norms, H, m);
+
+    float **corrupt_x = map_2d_func(func_choice, A, A, input);
+    insert_full_faults(A, corrupt_x, H, fault_low_bit, fault_high_bit,
+		       fault_count);
+    const float **corrupt_norms = (const float**) calc_2d_norm(A, (const float**) corrupt_x, grids);
+    serve_features(&stream, -1, grids, corrupt_norms, H, m);
+
+    double stall = feature_stream_close(&stream);
+    fprintf(stderr, "serve: %zu batches, blocked %f s on the consumer\n",
+	    stream.batches, stall);
+    return 0;
+
+  } else if (strcmp(mode, "train3d") == 0) {
+    run_options options;
+    int i = parse_run_options(argc, argv, &options);
+    assert(argc - i == 12);
+    // the 3D pipeline is single threaded, uncached and contiguous
+    check_run_options(mode, &options, RUN_OPTION_FORMAT);
+    features_format = options.format;
+    size_t func_choice = get_unsigned_long_long(argv[i++]);
+    assert(func_choice < NUM_FUNCTIONS);
+
+    float low = get_float(argv[i++]);
+    float high = get_float(argv[i++]);
+    assert(low < high);
+
+    size_t H = get_unsigned_long_long(argv[i++]);
+    size_t grids = H*L;
+    assert(H%L == 0);
+
+    size_t A = get_unsigned_long_long(argv[i++]);
+    assert(A%grids == 0);
+
+    size_t fault_low_bit = get_unsigned_long_long(argv[i++]);
+    size_t fault_high_bit = get_unsigned_long_long(argv[i++]);
+    assert(fault_low_bit <= fault_high_bit);
+
+    size_t fault_count = get_unsigned_long_long(argv[i++]);
+
+    int32_t m = get_unsigned_long_long(argv[i++]);
+
+    char *original_file = argv[i++];
+    char *low_file = argv[i++];
+    char *high_file = argv[i++];
+    open_feature_files(original_file, high_file, low_file, H, L*L*L);
+
+    const float *input = gen_3d_input(low, high, A);
+    size_t tiles = grids*grids*grids;
+    int32_t *hi = malloc(tiles*sizeof(int32_t));
+    int32_t *lo = malloc(tiles*sizeof(int32_t));
+    assert(hi != NULL && lo != NULL);
+
+    // Clean data
+    float *x = map_3d_func(func_choice, A, input);
+    float *norms = calc_3d_norm(A, x, grids);
+    split_3d_array(grids, grids, grids, norms, m, hi, lo);
+    print_3d_features(1, grids, norms, H, hi, lo);
+
+    //Corrupted, reusing the clean field
+    insert_full_3d_faults(A, x, H, fault_low_bit, fault_high_bit, fault_count);
+    float *corrupt_norms = calc_3d_norm(A, x, grids);
+    split_3d_array(grids, grids, grids, corrupt_norms, m, hi, lo);
+    print_3d_features(-1, grids, corrupt_norms, H, hi, lo);
+
+    close_feature_files();
+    return 0;
+
+  } else if (strcmp(mode, "exhaustive") == 0) {
+    assert(argc == 11 || argc == 12);
+    int i = 2;
+    size_t func_choice = get_unsigned_long_long(argv[i++]);
+    assert(func_choice < NUM_FUNCTIONS);
+
+    float low = get_float(argv[i++]);
+    float high = get_float(argv[i++]);
+    assert(low < high);
+
+    size_t H = get_unsigned_long_long(argv[i++]);
+    size_t grids = H*L;
+    assert(H%L == 0);
+
+    size_t A = get_unsigned_long_long(argv[i++]);
+    assert(A%grids == 0);
+
+    size_t fault_low_bit = get_unsigned_long_long(argv[i++]);
+    size_t fault_high_bit = get_unsigned_long_long(argv[i++]);
+    assert(fault_low_bit <= fault_high_bit);
+    assert(fault_high_bit < BITS_IN_FLOAT);
+
+    int32_t m = get_unsigned_long_long(argv[i++]);
+
+    char *summary_file = argv[i++];
+    char *table_file = (i < argc) ? argv[i++] : NULL;
+
+    const float **input = (const float**) gen_2d_input(low, high, A, A);
+    const float **x = (const float**) map_2d_func(func_choice, A, A, input);
+    const float **norms = (const float**) calc_2d_norm(A, x, grids);
+
+    exhaustive_norm_faults(grids, norms, m, fault_low_bit, fault_high_bit,
+			   summary_file, table_file);
+
+    return 0;
+
+  } else if (strcmp(mode, "simulate") == 0) {
+    assert(argc == 13);
+    int i = 2;
+    size_t func_choice = get_unsigned_long_long(argv[i++]);
+    assert(func_choice < NUM_FUNCTIONS);
+
+    float low = get_float(argv[i++]);
+    float high = get_float(argv[i++]);
+    assert(low < high);
+
+    size_t H = get_unsigned_long_long(argv[i++]);
+    size_t grids = H*L;
+    assert(H%L == 0);
+
+    size_t A = get_unsigned_long_long(argv[i++]);
+    assert(A%grids == 0);
+
+    size_t fault_low_bit = get_unsigned_long_long(argv[i++]);
+    size_t fault_high_bit = get_unsigned_long_long(argv[i++]);
+    assert(fault_low_bit <= fault_high_bit);
+    assert(fault_high_bit < BITS_IN_FLOAT);
+
+    size_t event_count = get_unsigned_long_long(argv[i++]);
+
+    int32_t m = get_unsigned_long_long(argv[i++]);
+
+    size_t T = get_unsigned_long_long(argv[i++]);
+    size_t interval = get_unsigned_long_long(argv[i++]);
+    assert(T > 0);
+    assert(interval > 0);
+
+    simulate(func_choice, low, high, H, A, fault_low_bit, fault_high_bit,
+	     event_count, m, T, interval);
+
+    return 0;
+
+  } else if (strcmp(mode, "toeplitz") == 0) {
+    // bit-exactness and speed of map_2d_func_toeplitz against the plain path
+    assert(argc == 6);
+    int i = 2;
+    size_t func_choice = get_unsigned_long_long(argv[i++]);
+    assert(func_choice < NUM_FUNCTIONS);
+
+    float low = get_float(argv[i++]);
+    float high = get_float(argv[i++]);
+    assert(low < high);
+
+    size_t A = get_unsigned_long_long(argv[i++]);
+
+    double start = now_seconds();
+    const float **input = (const float**) gen_2d_input(low, high, A, A);
+    float **plain = map_2d_func(func_choice, A, A, input);
+    double plain_time = now_seconds() - start;
+
+    start = now_seconds();
+    size_t evaluations;
+    float **memo = map_2d_func_toeplitz(func_choice, low, high, A, &evaluations);
+    double memo_time = now_seconds() - start;
+
+    size_t mismatches = 0;
+    for (size_t x=0; x<A; x++) {
+      for (size_t y=0; y<A; y++) {
+	mismatches += (transmute(plain[x][y]) != transmute(memo[x][y]));
+      }
+    }
+
+    printf("entries, evaluations, mismatches, plain_seconds, memo_seconds\n");
+    printf("%zu, %zu, %zu, %f, %f\n", A*A, evaluations, mismatches,
+	   plain_time, memo_time);
+
+    return (mismatches == 0) ? 0 : 1;
+
+  } else if (strcmp(mode, "batch") == 0) {
+    // batch func low high A grids count m reps
+    assert(argc == 10);
+    int i = 2;
+    size_t func_choice = get_unsigned_long_long(argv[i++]);
+    assert(func_choice < NUM_FUNCTIONS);
+
+    float low = get_float(argv[i++]);
+    float high = get_float(argv[i++]);
+    assert(low < high);
+
+    size_t A = get_unsigned_long_long(argv[i++]);
+    size_t grids = get_unsigned_long_long(argv[i++]);
+    assert(grids > 0 && A%grids == 0);
+
+    size_t count = get_unsigned_long_long(argv[i++]);
+    assert(count > 0);
+
+    int32_t m = get_unsigned_long_long(argv[i++]);
+    size_t reps = get_unsigned_long_long(argv[i++]);
+
+    size_t mismatches = benchmark_batch(func_choice, low, high, A, grids,
+					count, m, reps);
+
+    return (mismatches == 0) ? 0 : 1;
+
+  } else if (strcmp(mode, "merge") == 0) {
+    // merge out shard_0 ... shard_N-1
+    assert(argc >= 4);
+    merge_feature_files(argv[2], &(argv[3]), argc - 3);
+
+    return 0;
+
+  } else if (strcmp(mode, "decode") == 0) {
+    assert(argc == 4);
+    decode_feature_file(argv[2], argv[3]);
+
+    return 0;
 
   } else if (strcmp(mode, "OTHER_MODE") == 0) {
     assert(0);
@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <math.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <assert.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "precision_kernels.h"
+
+/* The toy pipeline with the precision chosen at run time, from the
+ * instantiations in precision_kernels.h. A single run can sweep several
+ * precisions over the same input and the same faults.
+ */
+
+/* Functions must take in a double and return a double, they can be defined
+ * locally or from a library. Make sure to match NUM_FUNCTIONS and the
+ * length of FUNCTIONS
+ */
+typedef double (*Class2Func)(double);
+static const size_t NUM_FUNCTIONS = 2;
+static Class2Func FUNCTIONS[] = {&sin, &cos};
+
+static const size_t DEFAULT_CHUNK_SIZE = 1<<16;
+
+
+char * EXECNAME;
+void
+usage()
+{
+  printf("usage: %s --function <int:0-%ld>\n", EXECNAME, NUM_FUNCTIONS);
+  printf("\t--lower-input <float> --higher-input <float>\n");
+  printf("\t--steps <int:1-%ld>\n", SIZE_MAX);
+  printf("\t--lower-bit <int:0-63> --higher-bit <int:0-63>\n");
+  printf("\t--fault-count <int:0-%ld>\n", SIZE_MAX);
+  printf("\t--m <int:1-%" PRIu64 ">\n", UINT64_MAX);
+  printf("\t[--precision <f32|f64|f32m64|all>[,...]] [--seed <int>]\n");
+  printf("\t[--chunk-size <int:1-%ld>] [--format <csv|columnar>]\n", SIZE_MAX);
+  printf("\n");
+}
+
+
+unsigned long long
+get_unsigned_long_long(const char *in)
+{
+  char * pt;
+  errno = 0;
+  unsigned long long out = strtoull(in, &pt, 0);
+  if (errno == ERANGE ||
+      errno == EINVAL ||
+      in+strlen(in) != pt) {
+    usage();
+    exit(-1);
+  }
+  return out;
+}
+
+
+double
+get_double(const char *in)
+{
+  char * pt;
+  errno = 0;
+  double out = strtod(in, &pt);
+  if (errno == ERANGE ||
+      errno == EINVAL ||
+      in+strlen(in) != pt) {
+    usage();
+    exit(-1);
+  }
+  return out;
+}
+
+
+/* Parses a comma separated list of precision names into 'selected' */
+void
+parse_precisions(const char *list, int *selected)
+{
+  char *copy = strdup(list);
+  assert(copy != NULL);
+
+  char *save = NULL;
+  for (char *name=strtok_r(copy, ",", &save); name != NULL;
+       name=strtok_r(NULL, ",", &save)) {
+    int found = 0;
+    for (size_t p=0; p<PK_NUM_PRECISIONS; p++) {
+      if (strcmp(name, "all") == 0 || strcmp(name, PK_PRECISIONS[p].name) == 0) {
+	selected[p] = 1;
+	found = 1;
+      }
+    }
+    if (!found) {
+      printf("argument precision must be f32, f64, f32m64 or all\ngiven %s\n",
+	     name);
+      exit(-1);
+    }
+  }
+
+  free(copy);
+}
+
+
+int
+main(int argc, char **argv)
+{
+  EXECNAME = argv[0];
+  int c;
+  int used_args = 0;
+  pk_config config;
+  memset(&config, 0, sizeof(config));
+  config.chunk_size = DEFAULT_CHUNK_SIZE;
+  int selected[sizeof(PK_PRECISIONS)/sizeof(PK_PRECISIONS[0])] = {0};
+  int any_selected = 0;
+  unsigned int seed = (unsigned int) time(NULL);
+  int columnar = 0;
+  unsigned long long temp;
+
+  while (1) {
+    static struct option long_options[] =
+      {
+	{"function", required_argument, NULL, 'f'},
+	{"lower-input", required_argument, NULL, 'l'},
+	{"higher-input", required_argument, NULL, 'h'},
+	{"steps", required_argument, NULL, 's'},
+	{"lower-bit", required_argument, NULL, 'd'},
+	{"higher-bit", required_argument, NULL, 'a'},
+	{"fault-count", required_argument, NULL, 'c'},
+	{"m", required_argument, NULL, 'm'},
+	{"chunk-size", required_argument, NULL, 'k'},
+	{"precision", required_argument, NULL, 'p'},
+	{"seed", required_argument, NULL, 'r'},
+	{"format", required_argument, NULL, 'o'},
+	{0, 0, 0, 0}
+      };
+
+    int option_index = 0;
+
+    c = getopt_long (argc, argv, "f:h:l:s:d:a:c:m:k:p:r:o:", long_options, &option_index);
+
+    /* Detect the end of the options. */
+    if (c == -1)
+      break;
+
+    switch (c)
+      {
+      case 'f':
+	used_args++;
+	temp = get_unsigned_long_long(optarg);
+	if (temp >= NUM_FUNCTIONS) {
+	  printf("argument function must be between 0 and %ld\ngiven %llu\n",
+		 NUM_FUNCTIONS-1, temp);
+	  exit(-1);
+	}
+	config.func = FUNCTIONS[temp];
+	break;
+
+      case 'l':
+	used_args++;
+	config.low = get_double(optarg);
+	break;
+
+      case 'h':
+	used_args++;
+	config.high = get_double(optarg);
+	break;
+
+      case 's':
+	used_args++;
+	config.steps = get_unsigned_long_long(optarg);
+	if (config.steps == 0) {
+	  printf("argument steps must be greater than 0\n");
+	  exit(-1);
+	}
+	break;
+
+      case 'd':
+	used_args++;
+	config.fault_low_bit = get_unsigned_long_long(optarg);
+	break;
+
+      case 'a':
+	used_args++;
+	config.fault_high_bit = get_unsigned_long_long(optarg);
+	break;
+
+      case 'c':
+	used_args++;
+	config.fault_count = get_unsigned_long_long(optarg);
+	break;
+
+      case 'm':
+	used_args++;
+	config.m = get_unsigned_long_long(optarg);
+	if (config.m == 0) {
+	  printf("argument m must be greater than 0\n");
+	  exit(-1);
+	}
+	break;
+
+      case 'k':
+	config.chunk_size = get_unsigned_long_long(optarg);
+	if (config.chunk_size == 0) {
+	  printf("argument chunk-size must be greater than 0\n");
+	  exit(-1);
+	}
+	break;
+
+      case 'p':
+	parse_precisions(optarg, selected);
+	any_selected = 1;
+	break;
+
+      case 'r':
+	seed = (unsigned int) get_unsigned_long_long(optarg);
+	break;
+
+      case 'o':
+	if (strcmp(optarg, "csv") == 0) {
+	  columnar = 0;
+	} else if (strcmp(optarg, "columnar") == 0) {
+	  columnar = 1;
+	} else {
+	  printf("argument format must be csv or columnar\ngiven %s\n", optarg);
+	  exit(-1);
+	}
+	break;
+
+      default:
+	usage();
+	exit(-1);
+      }
+  }
+
+  if (used_args < 8) {
+    usage();
+    exit(-1);
+  }
+  if (!any_selected) {
+    selected[0] = 1;
+  }
+
+  if (config.fault_low_bit > config.fault_high_bit) {
+    printf("higher-bit must be larger, or equal to, lower-bit\n");
+    exit(-1);
+  }
+  if (config.low >= config.high) {
+    printf("higher-input must be larger than lower-input\n");
+    exit(-1);
+  }
+  if (config.fault_count > config.steps) {
+    printf("fault-count must be smaller than, or equal to, steps\n");
+    exit(-1);
+  }
+  for (size_t p=0; p<PK_NUM_PRECISIONS; p++) {
+    if (!selected[p]) {
+      continue;
+    }
+    if (config.fault_high_bit >= PK_PRECISIONS[p].float_bits) {
+      printf("higher-bit must be below %zu for %s\n",
+	     PK_PRECISIONS[p].float_bits, PK_PRECISIONS[p].name);
+      exit(-1);
+    }
+    if (config.m > PK_PRECISIONS[p].max_m) {
+      printf("m must be at most %" PRIu64 " for %s\n",
+	     PK_PRECISIONS[p].max_m, PK_PRECISIONS[p].name);
+      exit(-1);
+    }
+  }
+
+  fflush(stdout);
+  async_writer *out = async_writer_fdopen(fileno(stdout), 0);
+  if (!columnar) {
+    const char *precision_column = "precision, ";
+    async_writer_write(out, precision_column, strlen(precision_column));
+    async_writer_write(out, PK_CSV_HEADER, strlen(PK_CSV_HEADER));
+  }
+
+  pk_stats stats[sizeof(PK_PRECISIONS)/sizeof(PK_PRECISIONS[0])];
+  for (size_t p=0; p<PK_NUM_PRECISIONS; p++) {
+    if (!selected[p]) {
+      continue;
+    }
+    // the same seed for every precision taints the same entries and bits
+    srand(seed);
+    // columnar output is one header and its blocks per precision
+    if (columnar) {
+      PK_PRECISIONS[p].run_columnar(&config, out, &(stats[p]));
+    } else {
+      config.name = PK_PRECISIONS[p].name;
+      PK_PRECISIONS[p].run_csv(&config, out, &(stats[p]));
+    }
+  }
+
+  const char *backend = async_writer_backend_name(out);
+  double stall = async_writer_close(out);
+  fprintf(stderr, "output (%s): compute stalled %f s waiting on buffers\n",
+	  backend, stall);
+
+  fprintf(stderr, "precision, rows, tainted, hi_changed, lo_changed, undetected\n");
+  for (size_t p=0; p<PK_NUM_PRECISIONS; p++) {
+    if (selected[p]) {
+      fprintf(stderr, "%s, %" PRIu64 ", %" PRIu64 ", %" PRIu64 ", %" PRIu64
+	      ", %" PRIu64 "\n", PK_PRECISIONS[p].name, stats[p].rows,
+	      stats[p].tainted, stats[p].hi_changed, stats[p].lo_changed,
+	      stats[p].undetected);
+    }
+  }
+
+  return 0;
+}
@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <math.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -8,35 +10,15 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <pthread.h>
 
-#include "static_assert.h"
+#include "async_writer.h"
+#include "precision_kernels.h"
 
-#ifdef USE_32_BIT
-typedef float myfloat;
-typedef uint32_t myuint;
-typedef uint64_t myulong;
-const char *RESULT_FORMAT_STRING="%f, %f, %f, %d, %u, %u, %u, %u\n";
-const long MYUINT_MAX = UINT32_MAX;
-
-#elif defined USE_64_BIT
-typedef double myfloat;
-typedef uint64_t myuint;
-typedef __uint128_t myulong;
-const char *RESULT_FORMAT_STRING="%f, %f, %f, %d, %lu, %lu, %lu, %lu\n";
-const long MYUINT_MAX = UINT64_MAX;
-
-#else
-#error "Must define either USE_32_BIT or USE_64_BIT"
-#endif
-
-
-STATIC_ASSERT(sizeof(myfloat) == sizeof(myuint), 
-	      "myfloat and myuint must have the same size");
-STATIC_ASSERT(sizeof(myulong) == 2*sizeof(myuint), 
-	      "myulong must be twice as big as myuint");
-
-
-static size_t BITS_IN_MYFLOAT = 8*sizeof(myfloat);
+/* The precision is picked at run time with --precision, from the
+ * instantiations in precision_kernels.h; every mode runs on its kernels.
+ */
+#define MAX_BITS 64
 
 /* Functions must tak in a double and return a double, they can be defined 
  * locally or from a library. Make sure to match NUM_FUNCTIONS and the
@@ -46,208 +28,437 @@ typedef double (*Class2Func)(double);
 static const size_t NUM_FUNCTIONS = 2;
 static Class2Func FUNCTIONS[] = {&sin, &cos};
 
-typedef union _transmutor {
-  myfloat fl;
-  myuint  ui;
-} transmutor;
 
+static const int MAX_THREADS = 256;
 
-myuint
-transmute_fl_to_ui(const myfloat f)
+char * EXECNAME;
+void
+usage()
 {
-  transmutor t; t.fl = f;
-  return t.ui;
+  printf("usage: %s --function <int:0-%ld>\n", EXECNAME, NUM_FUNCTIONS);
+  printf("\t--lower-input <float> --higher-input <float>\n");
+  printf("\t--steps <int:1-%ld>\n", SIZE_MAX);
+  printf("\t--lower-bit <int:0-%d> --higher-bit <int:0-%d>\n",
+	 MAX_BITS-1, MAX_BITS-1);
+  printf("\t--m <int:1-%" PRIu64 ">\n", UINT64_MAX);
+  printf("\t--fault-count <int:0-%ld> (unless --trials or --exhaustive)\n",
+	 SIZE_MAX);
+  printf("\t[--chunk-size <int:1-%ld>] [--format <csv|columnar>]\n", SIZE_MAX);
+  printf("\t[--trials <int:1-%ld> [--threads <int:1-%d>]]\n",
+	 SIZE_MAX, MAX_THREADS);
+  printf("\t[--exhaustive[=<summary|table>]]\n");
+  printf("\t[--precision <f32|f64|f32m64>]\n");
+  printf("\tlower-bit, higher-bit and m must fit the precision, f32 if not given\n");
+  printf("\n");
 }
 
 
-myfloat
-transmute_ui_to_fl(const myuint u)
+unsigned long long
+get_unsigned_long_long(const char *in)
 {
-  transmutor t; t.ui = u;
-  return t.fl;
+  char * pt;
+  errno = 0;
+  unsigned long long out = strtoull(in, &pt, 0);
+  if (errno == ERANGE ||
+      errno == EINVAL ||
+      in+strlen(in) != pt) {
+    usage();
+    exit(-1);
+  }
+  return out;
 }
 
 
-myfloat *
-gen_input(const myfloat low, const myfloat high, const size_t steps)
+double
+get_double(const char *in)
 {
-  assert(low < high);
+  char * pt;
+  errno = 0;
+  double out = strtod(in, &pt);
+  if (errno == ERANGE ||
+      errno == EINVAL ||
+      in+strlen(in) != pt) {
+    usage();
+    exit(-1);
+  }
+  return out; 
+}
 
-  myfloat * output = malloc(steps*sizeof(myfloat));
-  assert(output != NULL);
 
-  myfloat difference = high-low;
-  myfloat step_size = difference/steps;
-  
-  for (size_t i=0; i<steps; i++) {
-    output[i] = low + (i*step_size);
+const pk_precision *
+get_precision(const char *in)
+{
+  for (size_t p=0; p<PK_NUM_PRECISIONS; p++) {
+    if (strcmp(in, PK_PRECISIONS[p].name) == 0) {
+      return &(PK_PRECISIONS[p]);
+    }
   }
+  printf("argument precision must be f32, f64 or f32m64\ngiven %s\n", in);
+  exit(-1);
+}
 
-  return output;
+
+/* All row output goes through an async_writer on stdout, so formatting
+ * overlaps with the disk writes. The time spent waiting on the writer is
+ * reported on stderr.
+ */
+async_writer *
+open_output()
+{
+  fflush(stdout);
+  return async_writer_fdopen(fileno(stdout), 0);
 }
 
 
-myfloat *
-map_func(const size_t func_choice, const size_t steps, const myfloat *input)
+void
+close_output(async_writer *out)
 {
-  assert(func_choice < NUM_FUNCTIONS);
-  assert(input != NULL);
+  const char *backend = async_writer_backend_name(out);
+  double stall = async_writer_close(out);
+  fprintf(stderr, "output (%s): compute stalled %f s waiting on buffers\n",
+	  backend, stall);
+}
+
+
+typedef enum _output_format {
+  FORMAT_CSV,
+  FORMAT_COLUMNAR
+} output_format;
 
-  myfloat *output = malloc(steps * sizeof(myfloat));
-  assert(output != NULL);
+static const size_t DEFAULT_CHUNK_SIZE = 1<<16;
 
-  Class2Func func = FUNCTIONS[func_choice];
-  for (size_t i=0; i<steps; i++) {
-    output[i] = func(input[i]);
+
+/* Runs the pipeline of precision_kernels.h at 'precision' over blocks of
+ * at most 'chunk_size' steps, so memory use does not depend on 'steps'.
+ * Faulty entries are chosen without replacement, so exactly 'fault_count'
+ * rows are tainted.
+ */
+void
+run_chunked(const pk_precision *precision, const size_t func_choice,
+	    const double low, const double high,
+	    const uint64_t steps, const size_t chunk_size,
+	    const size_t fault_low_bit, const size_t fault_high_bit,
+	    const uint64_t fault_count, const uint64_t m,
+	    const output_format format)
+{
+  assert(precision != NULL);
+  assert(func_choice < NUM_FUNCTIONS);
+
+  pk_config config;
+  memset(&config, 0, sizeof(config));
+  config.func = FUNCTIONS[func_choice];
+  config.low = low;
+  config.high = high;
+  config.steps = steps;
+  config.chunk_size = chunk_size;
+  config.fault_low_bit = fault_low_bit;
+  config.fault_high_bit = fault_high_bit;
+  config.fault_count = fault_count;
+  config.m = m;
+
+  pk_stats stats;
+  async_writer *out = open_output();
+  if (format == FORMAT_CSV) {
+    async_writer_write(out, PK_CSV_HEADER, strlen(PK_CSV_HEADER));
+    precision->run_csv(&config, out, &stats);
+  } else {
+    precision->run_columnar(&config, out, &stats);
   }
+  close_output(out);
+}
+
+
+
+/* Monte Carlo trials: every trial picks one entry of the input range, flips
+ * one bit of f(input) and compares the hi/lo split of the clean and faulty
+ * value in-process. Only the per bit summary is kept, so the number of
+ * trials is limited by time rather than by memory or disk.
+ */
+
+typedef struct _trial_stats {
+  uint64_t trials[MAX_BITS];
+  uint64_t detected[MAX_BITS];
+  uint64_t hi_changed[MAX_BITS];
+  uint64_t lo_changed[MAX_BITS];
+  /* indexed by the bit length of |y' - y|, 0 meaning no change */
+  uint64_t hi_delta_hist[MAX_BITS][MAX_BITS+1];
+  uint64_t lo_delta_hist[MAX_BITS][MAX_BITS+1];
+} trial_stats;
 
-  return output;
+
+/* rand() is shared state, each thread draws from its own splitmix64 */
+uint64_t
+splitmix64(uint64_t *state)
+{
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
 }
 
 
-size_t
-rand_size(size_t low, size_t high)
+uint64_t
+rand_range_r(uint64_t *state, const uint64_t low, const uint64_t high)
 {
   assert(low <= high);
 
-  size_t range = (high - low);
-  return low + (rand() % (range+1));
+  uint64_t range = high - low;
+  if (range == UINT64_MAX) {
+    return splitmix64(state);
+  }
+  return low + (splitmix64(state) % (range+1));
 }
 
 
-myfloat *
-insert_faults(const size_t steps, const myfloat *input,
-	      const size_t fault_low_bit, const size_t fault_high_bit, 
-	      const uint64_t fault_count, 
-	      char **fault_locations_out)
+size_t
+delta_bucket(const uint64_t a, const uint64_t b)
 {
-  assert(input != NULL);
-  assert(fault_low_bit <= fault_high_bit);
-  assert(fault_locations_out != NULL);
-
-  myfloat *output =  malloc(steps*sizeof(myfloat));
-  char *fault_locations = malloc(steps*sizeof(char));
-  assert(fault_locations != NULL);
-  memset(fault_locations, -1, steps*sizeof(char));
-  *fault_locations_out = fault_locations;
-
-  for (size_t iter=0; iter<fault_count; iter++) {
-    size_t target_entry = rand_size(0, steps-1);
-    size_t target_bit = rand_size(fault_low_bit, fault_high_bit);
-    assert(target_entry < steps);
-    assert(target_bit < BITS_IN_MYFLOAT);
-
-    myuint hex = transmute_fl_to_ui(input[target_entry]);
-    hex ^= 1<<target_bit;
-    output[target_entry] = transmute_ui_to_fl(hex);
-    assert(transmute_fl_to_ui(input[target_entry]) != 
-	   transmute_fl_to_ui(output[target_entry]));
-
-    fault_locations[target_entry] = target_bit;
+  uint64_t delta = (a > b) ? a-b : b-a;
+  size_t bucket = 0;
+  while (delta != 0) {
+    bucket++;
+    delta >>= 1;
   }
+  return bucket;
+}
 
-  for (size_t index=0; index<steps; index++) {
-    if (fault_locations[index] == -1) {
-      output[index] = input[index];
-    }
-  }
 
-  return output;
+void
+record_trial(trial_stats *stats, const size_t bit, const pk_outcome *outcome)
+{
+  assert(stats != NULL);
+  assert(bit < MAX_BITS);
+  assert(outcome != NULL);
+
+  int hi_changed = (outcome->y_hi != outcome->yp_hi);
+  int lo_changed = (outcome->y_lo != outcome->yp_lo);
+
+  stats->trials[bit]++;
+  stats->detected[bit] += (hi_changed || lo_changed);
+  stats->hi_changed[bit] += hi_changed;
+  stats->lo_changed[bit] += lo_changed;
+  stats->hi_delta_hist[bit][delta_bucket(outcome->y_hi, outcome->yp_hi)]++;
+  stats->lo_delta_hist[bit][delta_bucket(outcome->y_lo, outcome->yp_lo)]++;
 }
 
 
 void
-mulhi_and_mullo(const size_t steps, const myfloat *input, const myuint m, 
-		myuint **hi_out, myuint **lo_out)
+merge_trial_stats(trial_stats *into, const trial_stats *from)
 {
-  assert(input != NULL);
-  assert(hi_out != NULL);
-  assert(lo_out != NULL);
-  
-  myuint *hi = malloc(steps * sizeof(myuint));
-  assert(hi != NULL);
-  *hi_out = hi;
-  myuint *lo = malloc(steps * sizeof(myuint));
-  assert(lo != NULL);
-  *lo_out = lo;
-
-  for (size_t i=0; i<steps; i++) {
-    myuint hex = transmute_fl_to_ui(input[i]);
-    myulong res = (myulong) hex * m;
-    hi[i] = (myuint) (res >> BITS_IN_MYFLOAT);
-    lo[i] = (myuint) ((res << BITS_IN_MYFLOAT) >> BITS_IN_MYFLOAT);
+  assert(into != NULL);
+  assert(from != NULL);
+
+  for (size_t bit=0; bit<MAX_BITS; bit++) {
+    into->trials[bit] += from->trials[bit];
+    into->detected[bit] += from->detected[bit];
+    into->hi_changed[bit] += from->hi_changed[bit];
+    into->lo_changed[bit] += from->lo_changed[bit];
+    for (size_t bucket=0; bucket<=MAX_BITS; bucket++) {
+      into->hi_delta_hist[bit][bucket] += from->hi_delta_hist[bit][bucket];
+      into->lo_delta_hist[bit][bucket] += from->lo_delta_hist[bit][bucket];
+    }
   }
 }
 
 
-char * EXECNAME;
-void
-usage()
+typedef struct _trial_job {
+  const pk_precision *precision;
+  size_t func_choice;
+  double low;
+  double step_size;
+  uint64_t steps;
+  size_t fault_low_bit;
+  size_t fault_high_bit;
+  uint64_t m;
+  uint64_t trials;
+  uint64_t seed;
+  trial_stats stats;
+} trial_job;
+
+
+void *
+run_trial_job(void *arg)
 {
-  printf("usage: %s --function <int:0-%ld>\n", EXECNAME, NUM_FUNCTIONS);
-  printf("\t--lower-input <float> --higher-input <float>\n");
-  printf("\t--steps <int:1-%ld>\n", SIZE_MAX);
-  printf("\t--lower-bit <int:0-%ld> --higher-bit <int:0-%ld>\n", 
-	 BITS_IN_MYFLOAT, BITS_IN_MYFLOAT);
-  printf("\t--fault-count <int:0-%ld>\n", SIZE_MAX);
-  printf("\t--m <int:0-%ld>\n", MYUINT_MAX);
-  printf("\n");
+  trial_job *job = arg;
+  assert(job != NULL);
+
+  Class2Func func = FUNCTIONS[job->func_choice];
+  uint64_t state = job->seed;
+
+  for (uint64_t trial=0; trial<job->trials; trial++) {
+    uint64_t entry = rand_range_r(&state, 0, job->steps-1);
+    size_t bit = rand_range_r(&state, job->fault_low_bit, job->fault_high_bit);
+
+    double x;
+    pk_outcome outcome;
+    job->precision->points(func, job->low, job->step_size, entry, 1, &x);
+    job->precision->flip_bits(x, job->m, bit, bit, &outcome);
+    record_trial(&(job->stats), bit, &outcome);
+  }
+
+  return NULL;
 }
 
 
-unsigned long long
-get_unsigned_long_long(const char *in)
+void
+print_trial_stats(const trial_stats *stats,
+		  const size_t fault_low_bit, const size_t fault_high_bit)
 {
-  char * pt;
-  unsigned long long out = strtoull(in, &pt, 0);
-  if (errno == ERANGE ||
-      errno == EINVAL ||
-      in+strlen(in) != pt) {
-    usage();
-    exit(-1);
+  assert(stats != NULL);
+
+  printf("bit, trials, detected, detection_rate, hi_changed, lo_changed\n");
+  for (size_t bit=fault_low_bit; bit<=fault_high_bit; bit++) {
+    double rate = (stats->trials[bit] == 0) ? 0.0 :
+      (double) stats->detected[bit] / stats->trials[bit];
+    printf("%zu, %lu, %lu, %f, %lu, %lu\n", bit,
+	   (unsigned long) stats->trials[bit],
+	   (unsigned long) stats->detected[bit], rate,
+	   (unsigned long) stats->hi_changed[bit],
+	   (unsigned long) stats->lo_changed[bit]);
+  }
+
+  printf("\nbit, part, delta_bits, count\n");
+  for (size_t bit=fault_low_bit; bit<=fault_high_bit; bit++) {
+    for (size_t bucket=0; bucket<=MAX_BITS; bucket++) {
+      if (stats->hi_delta_hist[bit][bucket] != 0) {
+	printf("%zu, hi, %zu, %lu\n", bit, bucket,
+	       (unsigned long) stats->hi_delta_hist[bit][bucket]);
+      }
+    }
+    for (size_t bucket=0; bucket<=MAX_BITS; bucket++) {
+      if (stats->lo_delta_hist[bit][bucket] != 0) {
+	printf("%zu, lo, %zu, %lu\n", bit, bucket,
+	       (unsigned long) stats->lo_delta_hist[bit][bucket]);
+      }
+    }
   }
-  return out;
 }
 
 
-myfloat
-get_myfloat(const char *in)
+void
+run_trials(const pk_precision *precision, const size_t func_choice,
+	   const double low, const double high, const uint64_t steps,
+	   const size_t fault_low_bit, const size_t fault_high_bit,
+	   const uint64_t m, const uint64_t trials, const int threads)
 {
-  char * pt;
-  myfloat out = (myfloat) strtod(in, &pt);
-  if (errno == ERANGE ||
-      errno == EINVAL ||
-      in+strlen(in) != pt) {
-    usage();
-    exit(-1);
+  assert(precision != NULL);
+  assert(low < high);
+  assert(fault_high_bit < precision->float_bits);
+  assert(threads > 0 && threads <= MAX_THREADS);
+
+  double step_size = precision->step_size(low, high, steps);
+
+  trial_job *jobs = malloc(threads*sizeof(trial_job));
+  pthread_t *handles = malloc(threads*sizeof(pthread_t));
+  assert(jobs != NULL);
+  assert(handles != NULL);
+
+  for (int t=0; t<threads; t++) {
+    memset(&(jobs[t]), 0, sizeof(trial_job));
+    jobs[t].precision = precision;
+    jobs[t].func_choice = func_choice;
+    jobs[t].low = low;
+    jobs[t].step_size = step_size;
+    jobs[t].steps = steps;
+    jobs[t].fault_low_bit = fault_low_bit;
+    jobs[t].fault_high_bit = fault_high_bit;
+    jobs[t].m = m;
+    jobs[t].trials = trials/threads + ((uint64_t) t < trials%threads);
+    jobs[t].seed = ((uint64_t) rand() << 32) ^ (uint64_t) rand() ^ t;
+    int err = pthread_create(&(handles[t]), NULL, run_trial_job, &(jobs[t]));
+    assert(err == 0);
   }
-  return out; 
+
+  trial_stats *total = calloc(1, sizeof(trial_stats));
+  assert(total != NULL);
+  for (int t=0; t<threads; t++) {
+    int err = pthread_join(handles[t], NULL);
+    assert(err == 0);
+    merge_trial_stats(total, &(jobs[t].stats));
+  }
+
+  print_trial_stats(total, fault_low_bit, fault_high_bit);
+
+  free(total);
+  free(handles);
+  free(jobs);
 }
 
 
+/* Exhaustive enumeration: every (entry, bit) pair in the fault range, with
+ * the faulty hi/lo derived from the clean product by pk_flip_bits.
+ * 'summary' reports the same per bit tables as the trials mode, 'table'
+ * writes one row per pair.
+ */
+typedef enum _exhaustive_report {
+  EXHAUSTIVE_NONE,
+  EXHAUSTIVE_SUMMARY,
+  EXHAUSTIVE_TABLE
+} exhaustive_report;
+
+
 void
-print_results(const size_t steps, const myfloat *input, 
-	      const myfloat *x, const myfloat *xp, const char *fault_locations,
-	      const myuint *y_hi, const myuint *y_lo,
-	      const myuint *yp_hi, const myuint *yp_lo)
+run_exhaustive(const pk_precision *precision, const size_t func_choice,
+	       const double low, const double high,
+	       const uint64_t steps, const size_t chunk_size,
+	       const size_t fault_low_bit, const size_t fault_high_bit,
+	       const uint64_t m, const exhaustive_report report)
 {
-  assert(input != NULL);
+  assert(precision != NULL);
+  assert(low < high);
+  assert(chunk_size > 0);
+  assert(fault_high_bit < precision->float_bits);
+  assert(report != EXHAUSTIVE_NONE);
+
+  double *x = malloc(chunk_size*sizeof(double));
   assert(x != NULL);
-  assert(xp != NULL);
-  assert(fault_locations != NULL);
-  assert(y_hi != NULL);
-  assert(y_lo != NULL);
-  assert(yp_hi != NULL);
-  assert(yp_lo != NULL);
-
-  printf("input. x, x', sdc_tainted, y_hi, y'_hi, y_lo, y'_lo\n");
-  for (size_t i=0; i<steps; i++) {
-    printf(RESULT_FORMAT_STRING,
-	   input[i],
-	   x[i], xp[i], fault_locations[i],
-	   y_hi[i], yp_hi[i],
-	   y_lo[i], yp_lo[i]);
+  pk_outcome outcomes[MAX_BITS];
+
+  double step_size = precision->step_size(low, high, steps);
+
+  trial_stats *stats = calloc(1, sizeof(trial_stats));
+  assert(stats != NULL);
+
+  // only the table streams rows, the summary is printed at the end
+  async_writer *out = NULL;
+  if (report == EXHAUSTIVE_TABLE) {
+    out = open_output();
+    const char *header = "index, bit, y_hi, y'_hi, y_lo, y'_lo\n";
+    async_writer_write(out, header, strlen(header));
   }
+
+  for (uint64_t start=0; start<steps; start+=chunk_size) {
+    size_t count = (steps-start < chunk_size) ? steps-start : chunk_size;
+
+    precision->points(FUNCTIONS[func_choice], low, step_size, start, count, x);
+
+    for (size_t i=0; i<count; i++) {
+      precision->flip_bits(x[i], m, fault_low_bit, fault_high_bit, outcomes);
+
+      for (size_t bit=fault_low_bit; bit<=fault_high_bit; bit++) {
+	const pk_outcome *outcome = &(outcomes[bit-fault_low_bit]);
+
+	if (report == EXHAUSTIVE_SUMMARY) {
+	  record_trial(stats, bit, outcome);
+	  continue;
+	}
+
+	async_writer_printf(out, "%" PRIu64 ", %zu, %" PRIu64 ", %" PRIu64
+			    ", %" PRIu64 ", %" PRIu64 "\n", start+i, bit,
+			    outcome->y_hi, outcome->yp_hi,
+			    outcome->y_lo, outcome->yp_lo);
+      }
+    }
+  }
+
+  if (report == EXHAUSTIVE_TABLE) {
+    close_output(out);
+  } else {
+    print_trial_stats(stats, fault_low_bit, fault_high_bit);
+  }
+
+  free(stats);
+  free(x);
 }
 
 
@@ -259,10 +470,21 @@ main(int argc, char **argv)
   EXECNAME = argv[0];
   int c;
   int used_args = 0;
-  size_t func_choice, fault_low_bit, fault_high_bit;
-  myfloat low, high;
-  myuint steps, fault_count, m;
-  long temp;
+  int fault_count_given = 0;
+  int chunk_size_given = 0;
+  int format_given = 0;
+  int threads_given = 0;
+  size_t func_choice = 0, fault_low_bit = 0, fault_high_bit = 0;
+  double low = 0, high = 0;
+  uint64_t steps = 0, fault_count = 0;
+  uint64_t m = 0;
+  size_t chunk_size = 0;
+  output_format format = FORMAT_CSV;
+  uint64_t trials = 0;
+  int threads = 1;
+  exhaustive_report exhaustive = EXHAUSTIVE_NONE;
+  const pk_precision *precision = &(PK_PRECISIONS[0]);
+  unsigned long long temp;
   
   while (1) {
     static struct option long_options[] =
@@ -275,12 +497,18 @@ main(int argc, char **argv)
 	{"higher-bit", required_argument, NULL, 'a'},
 	{"fault-count", required_argument, NULL, 'c'},
 	{"m", required_argument, NULL, 'm'},
+	{"chunk-size", required_argument, NULL, 'k'},
+	{"format", required_argument, NULL, 'o'},
+	{"trials", required_argument, NULL, 'n'},
+	{"threads", required_argument, NULL, 'j'},
+	{"exhaustive", optional_argument, NULL, 'e'},
+	{"precision", required_argument, NULL, 'p'},
 	{0, 0, 0, 0}
       };
 
     int option_index = 0;
 
-    c = getopt_long (argc, argv, "f:h:l:s:d:a:c:m:", long_options, &option_index);
+    c = getopt_long (argc, argv, "f:h:l:s:d:a:c:m:k:o:n:j:e::p:", long_options, &option_index);
 
     /* Detect the end of the options. */
     if (c == -1)
@@ -295,9 +523,9 @@ main(int argc, char **argv)
       case 'f':
 	used_args++;
 	temp = get_unsigned_long_long(optarg);
-	if (temp < 0 || temp > NUM_FUNCTIONS) {
-	  printf("argument function must be between 0 and %ld\ngiven %ld\n", 
-		 NUM_FUNCTIONS, temp);
+	if (temp >= NUM_FUNCTIONS) {
+	  printf("argument function must be between 0 and %ld\ngiven %llu\n", 
+		 NUM_FUNCTIONS-1, temp);
 	  exit(-1);
 	}
 	func_choice = (size_t) temp;
@@ -305,31 +533,31 @@ main(int argc, char **argv)
 
       case 'l':
 	used_args++;
-	low = get_myfloat(optarg);
+	low = get_double(optarg);
 	break;
 
       case 'h':
 	used_args++;
-	high = get_myfloat(optarg);
+	high = get_double(optarg);
 	break;
 
       case 's':
 	used_args++;
 	temp = get_unsigned_long_long(optarg);
 	if (temp <= 0) {
-	  printf("argument steps must be greater than 0\ngiven %ld\n", 
+	  printf("argument steps must be greater than 0\ngiven %llu\n", 
 		 temp);
 	  exit(-1);
 	}
-	steps = (myuint) temp;
+	steps = (uint64_t) temp;
 	break;
 
       case 'd':
 	used_args++;
 	temp = get_unsigned_long_long(optarg);
-	if (temp < 0 || temp > BITS_IN_MYFLOAT-1) {
-	  printf("argument lower-bit must be between 0 and %ld\ngiven %ld\n", 
-		 BITS_IN_MYFLOAT-1, temp);
+	if (temp > MAX_BITS-1) {
+	  printf("argument lower-bit must be between 0 and %d\ngiven %llu\n", 
+		 MAX_BITS-1, temp);
 	  exit(-1);
 	}
 	fault_low_bit = (size_t) temp;
@@ -338,34 +566,97 @@ main(int argc, char **argv)
       case 'a':
 	used_args++;
 	temp = get_unsigned_long_long(optarg);
-	if (temp < 0 || temp > BITS_IN_MYFLOAT-1) {
-	  printf("argument higher-bit must be between 0 and %ld\ngiven %ld\n", 
-		 BITS_IN_MYFLOAT-1, temp);
+	if (temp > MAX_BITS-1) {
+	  printf("argument higher-bit must be between 0 and %d\ngiven %llu\n", 
+		 MAX_BITS-1, temp);
 	  exit(-1);
 	}
 	fault_high_bit = (size_t) temp;
 	break;
 
       case 'c':
-	used_args++;
+	// only the csv and chunked runs place faults, trials and exhaustive
+	// flip every bit themselves
+	fault_count_given = 1;
 	temp = get_unsigned_long_long(optarg);
 	if (temp <= 0) {
-	  printf("argument fault-count must be greater than 0\ngiven %ld\n", 
+	  printf("argument fault-count must be greater than 0\ngiven %llu\n", 
 		 temp);
 	  exit(-1);
 	}
-	fault_count = (myuint) temp;
+	fault_count = (uint64_t) temp;
 	break;
 
       case 'm':
 	used_args++;
 	temp = get_unsigned_long_long(optarg);
 	if (temp <= 0) {
-	  printf("argument fault-count must be greater than 0\ngiven %ld\n", 
+	  printf("argument m must be greater than 0\ngiven %llu\n", 
+		 temp);
+	  exit(-1);
+	}
+	m = (uint64_t) temp;
+	break;
+
+      case 'k':
+	chunk_size_given = 1;
+	temp = get_unsigned_long_long(optarg);
+	if (temp <= 0) {
+	  printf("argument chunk-size must be greater than 0\ngiven %llu\n", 
+		 temp);
+	  exit(-1);
+	}
+	chunk_size = (size_t) temp;
+	break;
+
+      case 'o':
+	format_given = 1;
+	if (strcmp(optarg, "csv") == 0) {
+	  format = FORMAT_CSV;
+	} else if (strcmp(optarg, "columnar") == 0) {
+	  format = FORMAT_COLUMNAR;
+	} else {
+	  printf("argument format must be csv or columnar\ngiven %s\n", 
+		 optarg);
+	  exit(-1);
+	}
+	break;
+
+      case 'n':
+	temp = get_unsigned_long_long(optarg);
+	if (temp <= 0) {
+	  printf("argument trials must be greater than 0\ngiven %llu\n", 
 		 temp);
 	  exit(-1);
 	}
-	m = (myuint) temp;
+	trials = (uint64_t) temp;
+	break;
+
+      case 'j':
+	threads_given = 1;
+	temp = get_unsigned_long_long(optarg);
+	if (temp <= 0 || temp > MAX_THREADS) {
+	  printf("argument threads must be between 1 and %d\ngiven %llu\n", 
+		 MAX_THREADS, temp);
+	  exit(-1);
+	}
+	threads = (int) temp;
+	break;
+
+      case 'e':
+	if (optarg == NULL || strcmp(optarg, "summary") == 0) {
+	  exhaustive = EXHAUSTIVE_SUMMARY;
+	} else if (strcmp(optarg, "table") == 0) {
+	  exhaustive = EXHAUSTIVE_TABLE;
+	} else {
+	  printf("argument exhaustive must be summary or table\ngiven %s\n", 
+		 optarg);
+	  exit(-1);
+	}
+	break;
+
+      case 'p':
+	precision = get_precision(optarg);
 	break;
       }
   }
@@ -380,24 +671,69 @@ main(int argc, char **argv)
     exit(-1);
   }
 
-  if (low > high) {
-    printf("higher-input must be larger, or equal to, lower-input\n");
+  if (low >= high) {
+    printf("higher-input must be larger than lower-input\n");
+    exit(-1);
+  }
+
+  if (fault_high_bit >= precision->float_bits) {
+    printf("higher-bit must be below %zu for %s\n",
+	   precision->float_bits, precision->name);
+    exit(-1);
+  }
+  if (m > precision->max_m) {
+    printf("m must be at most %" PRIu64 " for %s\n",
+	   precision->max_m, precision->name);
     exit(-1);
   }
 
-  myfloat *input = gen_input(low, high, steps);
-  myfloat *x = map_func(func_choice, steps, input);
+  // exhaustive flips every bit of every entry, in chunk-size blocks
+  if (exhaustive != EXHAUSTIVE_NONE &&
+      (fault_count_given || format_given || trials > 0 || threads_given)) {
+    printf("fault-count, format, trials and threads cannot be used with"
+	   " exhaustive\n");
+    exit(-1);
+  }
 
-  char *fault_locations;
-  myfloat *xp = insert_faults(steps, x, 
-			      fault_low_bit, fault_high_bit, 
-			      fault_count, &fault_locations);
+  if (exhaustive != EXHAUSTIVE_NONE) {
+    run_exhaustive(precision, func_choice, low, high, steps,
+		   (chunk_size > 0) ? chunk_size : DEFAULT_CHUNK_SIZE,
+		   fault_low_bit, fault_high_bit, m, exhaustive);
+    return 0;
+  }
 
-  myuint *y_hi, *y_lo, *yp_hi, *yp_lo;
-  mulhi_and_mullo(steps, x, m, &y_hi, &y_lo);
-  mulhi_and_mullo(steps, xp, m, &yp_hi, &yp_lo);
-    
-  print_results(steps, input, x, xp, fault_locations, y_hi, y_lo, yp_hi, yp_lo);
+  // trials keep only the per bit summary in memory, nothing is streamed
+  if (trials > 0 &&
+      (fault_count_given || chunk_size_given || format_given)) {
+    printf("fault-count, chunk-size and format cannot be used with trials\n");
+    exit(-1);
+  }
+  if (trials == 0 && threads_given) {
+    printf("threads can only be used with trials\n");
+    exit(-1);
+  }
+
+  if (trials > 0) {
+    run_trials(precision, func_choice, low, high, steps,
+	       fault_low_bit, fault_high_bit, m, trials, threads);
+    return 0;
+  }
+
+  if (!fault_count_given) {
+    usage();
+    exit(-1);
+  }
+
+  if (fault_count > steps) {
+    printf("fault-count must be smaller than, or equal to, steps\n");
+    exit(-1);
+  }
+  // without --chunk-size the csv is streamed the same way, in default chunks
+  if (chunk_size == 0) {
+    chunk_size = DEFAULT_CHUNK_SIZE;
+  }
+  run_chunked(precision, func_choice, low, high, steps, chunk_size,
+	      fault_low_bit, fault_high_bit, fault_count, m, format);
   
   return 0;
 }
@@ -0,0 +1,23 @@
+#!/bin/sh
+# With --fault-count equal to --steps every row must be tainted, whatever
+# the chunk size. Half the count must taint exactly that many rows.
+
+set -e
+TOY=${TOY:-bin/toy}
+PRECISION=${PRECISION:-f32}
+STEPS=1000
+
+for chunk in 1 3 4 7 64 999 1000 4096; do
+  for count in $STEPS $((STEPS/2)); do
+    tainted=$($TOY --function 0 --lower-input -1 --higher-input 1 \
+		   --steps $STEPS --lower-bit 0 --higher-bit 31 \
+		   --fault-count $count --m 12345 --chunk-size $chunk \
+		   --precision $PRECISION |
+		tail -n +2 | awk -F', ' '$4 != -1' | wc -l)
+    if [ "$tainted" -ne "$count" ]; then
+      echo "FAIL: chunk-size $chunk fault-count $count tainted $tainted rows"
+      exit 1
+    fi
+  done
+done
+echo "PASS: $TOY $PRECISION fault-count"
@@ -0,0 +1,43 @@
+#!/bin/sh
+# train split into N --shard runs and merged must give the feature files of
+# the unsharded run with the same seed, byte for byte, in both formats. 40
+# shards is more than the 36 tiles, so some shards hold no tile at all.
+
+set -e
+EXPERIMENT=${EXPERIMENT:-bin/experiment}
+ARGS="0 -1 1 6 36 20 30 36 12345"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+for format in text varint; do
+  $EXPERIMENT train --seed 11 --feature-format $format $ARGS \
+	      "$dir/whole_o" "$dir/whole_l" "$dir/whole_h" 2>/dev/null
+
+  for shards in 1 5 7 40; do
+    k=0
+    while [ $k -lt $shards ]; do
+      $EXPERIMENT train --seed 11 --feature-format $format \
+		  --shard $k/$shards $ARGS \
+		  "$dir/shard_o_$k" "$dir/shard_l_$k" "$dir/shard_h_$k" 2>/dev/null
+      k=$((k+1))
+    done
+
+    for file in o l h; do
+      parts=""
+      k=0
+      while [ $k -lt $shards ]; do
+	parts="$parts $dir/shard_${file}_$k"
+	k=$((k+1))
+      done
+      $EXPERIMENT merge "$dir/merged_$file" $parts
+      if ! cmp -s "$dir/whole_$file" "$dir/merged_$file"; then
+	echo "FAIL: $format file $file merged from $shards shards differs"
+	exit 1
+      fi
+    done
+    rm -f "$dir"/shard_* "$dir"/merged_*
+  done
+  rm -f "$dir"/whole_*
+done
+echo "PASS: $EXPERIMENT shard merge"
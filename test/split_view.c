@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "mul_hi_lo.h"
+
+/* split_view must give the same dense hi/lo as split_float of each entry,
+ * whatever the layout: row-major and column-major with padding, and the
+ * interior of a halo padded column-major block. The shapes cover the in
+ * place path, whole VIEW_BLOCK tiles and partial ones.
+ */
+
+static const int32_t M = 12345;
+static const size_t HALO = 2;
+
+
+/* Value of entry (x, y), distinct across the field */
+float
+entry(const size_t x, const size_t y)
+{
+  return 0.25f + (float) x*1.5f - (float) y/7.0f;
+}
+
+
+/* Splits 'view' and compares it against the entries of an nx by ny field */
+int
+check_view(const char *name, const field_view *view, const size_t nx,
+	   const size_t ny)
+{
+  int32_t *hi = malloc(nx*ny*sizeof(int32_t));
+  int32_t *lo = malloc(nx*ny*sizeof(int32_t));
+  assert(hi != NULL);
+  assert(lo != NULL);
+
+  split_view(view, M, hi, lo);
+
+  int ok = 1;
+  for (size_t x=0; x<nx && ok; x++) {
+    for (size_t y=0; y<ny && ok; y++) {
+      int32_t want_hi, want_lo;
+      split_float(entry(x, y), M, &want_hi, &want_lo);
+      if (hi[x*ny + y] != want_hi || lo[x*ny + y] != want_lo) {
+	printf("FAIL: split_view %s %zux%zu differs at (%zu, %zu)\n",
+	       name, nx, ny, x, y);
+	ok = 0;
+      }
+    }
+  }
+
+  free(hi);
+  free(lo);
+  return ok;
+}
+
+
+int
+check_shape(const size_t nx, const size_t ny)
+{
+  int ok = 1;
+
+  // row-major, leading dimension padded by one
+  size_t ld = ny + 1;
+  float *row = calloc(nx*ld, sizeof(float));
+  assert(row != NULL);
+  for (size_t x=0; x<nx; x++) {
+    for (size_t y=0; y<ny; y++) {
+      row[x*ld + y] = entry(x, y);
+    }
+  }
+  field_view view = field_view_row_major(row, nx, ny, ld);
+  ok &= check_view("row-major", &view, nx, ny);
+  free(row);
+
+  // column-major, leading dimension padded by three
+  ld = nx + 3;
+  float *col = calloc(ld*ny, sizeof(float));
+  assert(col != NULL);
+  for (size_t x=0; x<nx; x++) {
+    for (size_t y=0; y<ny; y++) {
+      col[y*ld + x] = entry(x, y);
+    }
+  }
+  view = field_view_col_major(col, nx, ny, ld);
+  ok &= check_view("column-major", &view, nx, ny);
+  free(col);
+
+  // interior of a column-major block with HALO cells on every side
+  size_t px = nx + 2*HALO, py = ny + 2*HALO;
+  float *padded = calloc(px*py, sizeof(float));
+  assert(padded != NULL);
+  for (size_t x=0; x<nx; x++) {
+    for (size_t y=0; y<ny; y++) {
+      padded[(y+HALO)*px + x+HALO] = entry(x, y);
+    }
+  }
+  field_view whole = field_view_col_major(padded, px, py, px);
+  view = field_view_sub(&whole, HALO, HALO+nx, HALO, HALO+ny);
+  ok &= check_view("halo", &view, nx, ny);
+  free(padded);
+
+  return ok;
+}
+
+
+int
+main()
+{
+  const size_t shapes[][2] = {{1, 1}, {5, 7}, {32, 32}, {33, 70}, {100, 37}};
+  int ok = 1;
+  for (size_t s=0; s<sizeof(shapes)/sizeof(shapes[0]); s++) {
+    ok &= check_shape(shapes[s][0], shapes[s][1]);
+  }
+
+  if (!ok) {
+    return 1;
+  }
+  printf("PASS: split_view\n");
+  return 0;
+}
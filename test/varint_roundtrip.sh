@@ -0,0 +1,24 @@
+#!/bin/sh
+# train --feature-format varint, decoded, must give back byte for byte the
+# feature files of the same seeded run in text.
+
+set -e
+EXPERIMENT=${EXPERIMENT:-bin/experiment}
+ARGS="0 -1 1 3 36 20 30 9 12345"
+
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+$EXPERIMENT train --seed 7 $ARGS \
+	    "$dir/text_o" "$dir/text_l" "$dir/text_h" 2>/dev/null
+$EXPERIMENT train --seed 7 --feature-format varint $ARGS \
+	    "$dir/varint_o" "$dir/varint_l" "$dir/varint_h" 2>/dev/null
+
+for file in o l h; do
+  $EXPERIMENT decode "$dir/varint_$file" "$dir/decoded_$file"
+  if ! cmp -s "$dir/text_$file" "$dir/decoded_$file"; then
+    echo "FAIL: decoded varint feature file $file differs from the text one"
+    exit 1
+  fi
+done
+echo "PASS: $EXPERIMENT varint round trip"